@@ -0,0 +1,128 @@
+#!/bin/bash
+#
+# Benchmark suite (make bench): builds each kernel variant, runs it on the
+# shipped inputs for a short, fixed no. of timesteps and prints a table of
+# MLUPS (mean and standard deviation over the repeats) and the speedup over
+# the first variant, for every rank and thread count.
+#
+# Every run is also checked: its av_vels must match the first timesteps of
+# the reference series in check/ (the final states there are only for the
+# full runs).
+#
+# Settings, from the environment:
+#   CC, CFLAGS       compiler and base flags (make passes its own)
+#   BENCH_ITERS      timesteps per run (200)
+#   BENCH_WARMUP     runs of each case discarded before timing (1)
+#   BENCH_REPEATS    timed runs of each case (3)
+#   BENCH_INPUTS     grids to run ("128x128 128x256 256x256 1024x1024")
+#   BENCH_VARIANTS   variants to run, by name (all of those below)
+#   BENCH_RANKS      MPI rank counts ("1")
+#   BENCH_THREADS    OpenMP threads per rank ("1" and the no. of cores)
+#   BENCH_TOLERANCE  % difference allowed against the reference (1, as make check)
+#   BENCH_DIR        builds, runs and results.txt go here (bench.out)
+#   MPIRUN           MPI launcher ("mpirun")
+#
+# e.g.  make bench BENCH_INPUTS=1024x1024 BENCH_RANKS="1 2" BENCH_VARIANTS="aos simd"
+
+cd "$(dirname "$0")/.." || exit 1
+ROOT=$(pwd)
+
+CC=${CC:-mpicc}
+CFLAGS=${CFLAGS:--std=c99 -Wall -O3 -fopenmp}
+ITERS=${BENCH_ITERS:-200}
+WARMUP=${BENCH_WARMUP:-1}
+REPEATS=${BENCH_REPEATS:-3}
+INPUTS=${BENCH_INPUTS:-128x128 128x256 256x256 1024x1024}
+RANKS=${BENCH_RANKS:-1}
+CORES=$(nproc 2>/dev/null || echo 1)
+THREADS=${BENCH_THREADS:-$( [ "$CORES" -gt 1 ] && echo "1 $CORES" || echo 1 )}
+TOLERANCE=${BENCH_TOLERANCE:-1}
+DIR=${BENCH_DIR:-bench.out}
+MPIRUN=${MPIRUN:-mpirun}
+
+# name, extra compile flags, run-time arguments
+VARIANTS=(
+  "aos            |               |"
+  "aos-generic    |               |--specialise=no"
+  "aos-tb4        |               |--tb-depth=4"
+  "soa            |-DSOA          |"
+  "simd           |-DSIMD         |"
+  "simd-generic   |-DSIMD         |--specialise=no"
+  "aa             |-DAA           |"
+)
+SELECTED=${BENCH_VARIANTS:-$(for v in "${VARIANTS[@]}"; do echo "${v%%|*}"; done)}
+
+mkdir -p "$DIR" || exit 1
+DIR=$(cd "$DIR" && pwd)
+RESULTS="$DIR/results.txt"
+failed=0
+
+field() { echo "$1" | cut -d'|' -f"$2" | sed 's/^ *//; s/ *$//'; }
+
+# build each selected variant once
+for v in "${VARIANTS[@]}"; do
+  name=$(field "$v" 1)
+  echo " $SELECTED " | tr '\n' ' ' | grep -q " $name " || continue
+  flags=$(field "$v" 2)
+
+  echo "building $name ($CFLAGS $flags)"
+  $CC $CFLAGS $flags d2q9-bgk.c -lm -lpthread -o "$DIR/d2q9-bgk.$name" || { echo "build of $name failed"; exit 1; }
+done
+
+printf "%-10s %-14s %5s %7s %10s %8s %8s  %s\n" grid variant ranks threads MLUPS stddev speedup check | tee "$RESULTS"
+
+for grid in $INPUTS; do
+  params="input_$grid.params"
+  ref="check/$grid.av_vels.dat"
+
+  [ -f "$params" ] || { echo "no $params"; exit 1; }
+
+  # same parameters, fewer timesteps (line 3 of the parameter file)
+  short="$DIR/$grid.params"
+  sed "3s/.*/$ITERS/" "$params" > "$short"
+
+  for np in $RANKS; do
+    for nt in $THREADS; do
+      base=""
+
+      for v in "${VARIANTS[@]}"; do
+        name=$(field "$v" 1)
+        echo " $SELECTED " | tr '\n' ' ' | grep -q " $name " || continue
+        args=$(field "$v" 3)
+        run="$DIR/run.$grid.$name.$np.$nt"
+        mlups=""
+
+        mkdir -p "$run"
+
+        for ((rr = 0; rr < WARMUP + REPEATS; rr++)); do
+          (cd "$run" && OMP_NUM_THREADS=$nt $MPIRUN -np "$np" "$DIR/d2q9-bgk.$name" \
+             "$short" "$ROOT/obstacles_$grid.dat" $args > out.txt 2>&1)
+          value=$(awk -F'\t+' '/^Lattice updates:/ { print $2 + 0 }' "$run/out.txt")
+
+          [ -n "$value" ] || { value=0; echo "run of $name on $grid failed, see $run/out.txt"; }
+          [ "$rr" -ge "$WARMUP" ] && mlups="$mlups $value"
+        done
+
+        # the first ITERS entries of the reference series
+        check=$(awk -v tol="$TOLERANCE" -v n="$ITERS" '
+          NR == FNR { if (FNR <= n) ref[FNR] = $2; next }
+          { m++; d = $2 - ref[FNR]; if (d < 0) d = -d
+            if (ref[FNR] == 0 || d / (ref[FNR] < 0 ? -ref[FNR] : ref[FNR]) * 100 > tol) bad++ }
+          END { print (m == n && !bad) ? "PASS" : "FAIL" }' "$ref" "$run/av_vels.dat" 2>/dev/null)
+
+        [ "$check" = "PASS" ] || { check=FAIL; failed=1; }
+
+        # mean and standard deviation of the repeats, speedup over the first variant
+        read -r mean sd <<< "$(echo "$mlups" | awk '{ for (i = 1; i <= NF; i++) { s += $i; q += $i * $i }
+                                                      m = s / NF; v = q / NF - m * m
+                                                      printf "%.2f %.2f\n", m, (v > 0) ? sqrt(v) : 0 }')"
+        [ -n "$base" ] || base=$mean
+        speedup=$(awk -v m="$mean" -v b="$base" 'BEGIN { printf "%.2f", (b > 0) ? m / b : 0 }')
+
+        printf "%-10s %-14s %5d %7d %10s %8s %8s  %s\n" "$grid" "$name" "$np" "$nt" "$mean" "$sd" "$speedup" "$check" | tee -a "$RESULTS"
+      done
+    done
+  done
+done
+
+[ "$failed" -eq 0 ] || { echo "some runs did not match the reference av_vels"; exit 1; }
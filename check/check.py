@@ -60,13 +60,39 @@ class InputParser(argparse.ArgumentParser):
 parser = InputParser()
 parsed_args = parser.parse_args()
 
+# Binary final state (--output-format=binary): 8 byte magic, int32 nx, int32 ny,
+# then nx*ny records of float32 u_x, u_y, u, pressure and int32 obstacle
+FINAL_STATE_MAGIC = b"D2Q9FS01"
+FINAL_STATE_RECORD = np.dtype([("u_x", "<f4"), ("u_y", "<f4"), ("u", "<f4"),
+                               ("pressure", "<f4"), ("obstacle", "<i4")])
+
+def load_final_state(final_state_filename):
+    with open(final_state_filename, "rb") as final_state_file:
+        if final_state_file.read(8) != FINAL_STATE_MAGIC:
+            # Text: ii jj u_x u_y u pressure obstacle
+            final_state_file.seek(0)
+            return np.loadtxt(final_state_file, usecols=[0, 1, 5])
+
+        nx, ny = np.fromfile(final_state_file, dtype="<i4", count=2)
+        records = np.fromfile(final_state_file, dtype=FINAL_STATE_RECORD, count=nx*ny)
+
+        if records.size != nx*ny:
+            print "Binary final state file is truncated"
+            exit(1)
+
+        # Same columns as the text file: ii, jj, pressure
+        final_state = np.empty((nx*ny, 3))
+        final_state[:,0] = np.tile(np.arange(nx), ny)
+        final_state[:,1] = np.repeat(np.arange(ny), nx)
+        final_state[:,2] = records["pressure"]
+
+        return final_state
+
 def load_dat_files(av_vels_filename, final_state_filename):
     with open(av_vels_filename, "r") as av_vels_ref_file:
-        with open(final_state_filename, "r") as final_state_ref_file:
-            av_vels = np.loadtxt(av_vels_ref_file, usecols=[1])
-            final_state = np.loadtxt(final_state_ref_file, usecols=[0, 1, 5])
+        av_vels = np.loadtxt(av_vels_ref_file, usecols=[1])
 
-            return av_vels, final_state
+    return av_vels, load_final_state(final_state_filename)
 
 # Open reference and input files
 av_vels_ref, final_state_ref = load_dat_files(parsed_args.ref_av_vels_file[0], parsed_args.ref_final_state_file[0])
@@ -1,3 +1,3 @@
 #!/bin/bash
 
-python check.py --ref-av-vels-file 128x128.av_vels.dat --ref-final-state-file 128x128.final_state.dat --av-vels-file ../av_vels.dat --final-state-file ../final_state.dat
+python check.py --tolerance ${TOLERANCE:-1} --ref-av-vels-file 128x128.av_vels.dat --ref-final-state-file 128x128.final_state.dat --av-vels-file ../av_vels.dat --final-state-file ../final_state.dat
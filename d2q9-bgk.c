@@ -49,13 +49,70 @@
 ** if you choose a different obstacle file.
 */
 
+#define _POSIX_C_SOURCE 200809L /* posix_memalign(), mmap(), pread() */
+#define _DEFAULT_SOURCE         /* MAP_ANONYMOUS, madvise() */
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <math.h>
 #include <time.h>
 #include <sys/time.h>
 #include <sys/resource.h> /* angle brackets: standard library header file (searches dirs pre-designated by compiler/IDE first) */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 #include "mpi.h"          /* quotes: programmer-defined header file (searches this dir first, then same as <>) */
+#include "d2q9-bgk_obstacles.h"
+#include "d2q9-bgk_state.h"
+
+/* the AA pattern (in-place streaming) only has scalar kernels */
+#if defined(AA) && defined(SIMD)
+#error "AA streaming has no SIMD kernels, build with one of -DAA or -DSIMD"
+#endif
+
+/* reduced precision storage of the densities */
+#if defined(FP16) && defined(BF16)
+#error "build with one of -DFP16 or -DBF16"
+#endif
+#if defined(FP16) || defined(BF16)
+#define POP_REDUCED
+#endif
+#if defined(POP_REDUCED) && defined(SIMD)
+#error "reduced precision storage has no SIMD kernels, build without -DSIMD"
+#endif
+
+/* SIMD kernels need the planes of the SOA layout */
+#ifdef SIMD
+#ifndef SOA
+#define SOA
+#endif
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+#endif
+
+/* so does device offload (OpenMP target), which has kernels of its own */
+#ifdef OFFLOAD
+#ifndef _OPENMP
+#error "-DOFFLOAD needs OpenMP: build with -fopenmp (and the compiler's offload flags)"
+#endif
+#if defined(SIMD) || defined(AA) || defined(POP_REDUCED)
+#error "-DOFFLOAD cannot be combined with -DSIMD, -DAA, -DFP16 or -DBF16"
+#endif
+#ifndef SOA
+#define SOA
+#endif
+#endif
 
 /* define debug variables */
 /* #define DEBUG                    included */
@@ -65,15 +122,74 @@
 /* #define DEBUG_obstacleGrid       prints obstacle grid (*obstacles_ptr) values */
 /* #define DEBUG_init_checkpoints   prints checkpoints during initialise() execution */
 /* #define DEBUG_ranks_updn         prints ranks above & below current rank */
- #define DEBUG_state_timestep    /* prints params, cells, tmp_cells, obstacles, and obstacles_total in timestep */
+/* #define DEBUG_state_timestep     prints params, cells, tmp_cells and obstacles in timestep */
 
 /* macro to get size of an array */
 #define NELEMS(x)  (sizeof(x) / sizeof((x)[0]))
 
 #define NSPEEDS         9
+/* grid alignment in bytes (one cache line, one AVX-512 vector) */
+#define ALIGNMENT       64
+#define ALIGN_FLOATS    (ALIGNMENT / (int)sizeof(float))
+/* arrays from the arena start ALIASSKEW bytes further into a 4K page than
+** the one before, so no two streams of a timestep alias on a 4K offset */
+#define ALIASPAGE       4096
+#define ALIASSKEW       128
+/* alignment and rounding of the arena with --huge-pages=yes */
+#define HUGEPAGE        (2 * 1024 * 1024)
 /* output files for error checking in check.py */
 #define FINALSTATEFILE  "final_state.dat"
 #define AVVELSFILE      "av_vels.dat"
+/* the same for each member of an ensemble (--ensemble=), by its index */
+#define MEMBERFINALSTATEFILE  "final_state_%d.dat"
+#define MEMBERAVVELSFILE      "av_vels_%d.dat"
+/* upper bound on the length of one line of the text final state */
+#define FINALSTATELINE    128
+/* cells allocated ahead of the first row of a grid, for its west ghost cell (keeps SOA rows aligned) */
+#ifdef SOA
+#define GRIDLEAD        ALIGN_FLOATS
+#else
+#define GRIDLEAD        1
+#endif
+/* no. of cells between the starts of consecutive rows, room for both ghost columns */
+#ifdef SOA
+/* padded so every row of every speed plane starts on an aligned address */
+#define GRIDPITCH(nx)   (((nx) + 2 + ALIGN_FLOATS - 1) / ALIGN_FLOATS * ALIGN_FLOATS)
+#else
+#define GRIDPITCH(nx)   ((nx) + 2)
+#endif
+/* columns per tile for --skip-solid, a multiple of every SIMD_WIDTH so that runs
+** of tiles keep the vector loops whole (and, in SOA builds, aligned) */
+#define TILEWIDTH       32
+/* default no. of timesteps whose average velocities are reduced together */
+#define AVBATCH         1000
+/* least no. of av. velocities kept in memory with --av-vels=stream */
+#define AVSTREAMRING    65536
+/*
+** checkpoint (--checkpoint=): 8 byte CHECKPOINTMAGIC, int nx, int ny,
+** int iteration (timesteps done), then NSPEEDS float densities per cell
+** for all nx * ny cells in row-major order, then av_vels[0..iteration-1]
+** (native byte order); neither the no. of ranks nor the compiled layout
+** is recorded, so a run can resume with different ones
+*/
+#define CHECKPOINTMAGIC   "D2Q9CP01"
+#define CHECKPOINTHEADER  (8 + 3 * (int)sizeof(int))
+/* timesteps a checkpoint is left to be written in the background before it is waited for */
+#define CHECKPOINTLAG     100
+/*
+** default time to update a blocked cell relative to a fluid one, which the
+** partitioner (--blocked-cost=) weights rows by; measured on a grid with
+** every cell blocked against one with none: the two-grid kernels relax
+** every cell and then rebound the blocked ones, SIMD relaxing them at
+** vector speed but rebounding them one at a time, the AA kernels skip them
+*/
+#if defined(AA)
+#define BLOCKEDCOST     0.05f
+#elif defined(SIMD)
+#define BLOCKEDCOST     2.3f
+#else
+#define BLOCKEDCOST     1.15f
+#endif
 
 /* struct to hold the parameter values */
 typedef struct
@@ -85,14 +201,341 @@ typedef struct
   float density;      /* density per link */
   float accel;        /* density redistribution */
   float omega;        /* relaxation parameter */
+  int   local_ny;     /* no. of rows in this rank's slab (excluding halo rows) */
+  int   row_offset;   /* global index of the first row in this rank's slab */
+  int   local_nx;     /* no. of columns in this rank's block (nx unless --proc-grid splits columns) */
+  int   col_offset;   /* global index of its first column */
+  int   proc_rows;    /* process grid (--proc-grid=): proc_rows x proc_cols blocks, */
+  int   proc_cols;    /* 0 x 0 until initialise() picks one for auto */
+  int   proc_row;     /* this rank's block in it */
+  int   proc_col;
+  int   left, right;  /* ranks of the blocks west and east of it (periodic) */
+  int   pitch;        /* no. of cells between the starts of consecutive rows (>= local_nx) */
+  int   fluid_cells;  /* no. of non-blocked cells in the whole grid (all ranks) */
+  int   halo;         /* no. of halo rows on each side of the slab (--tb-depth, 1 without temporal blocking) */
+  float blocked_cost; /* cost of a blocked cell relative to a fluid one, for the partitioner (--blocked-cost=) */
+  float imbalance;    /* expected max / mean cost of the slabs the partitioner chose */
+  int   huge_pages;   /* back the arena with transparent huge pages (--huge-pages=yes) */
+  int   skip_solid;   /* never update tiles that are solid along with their neighbours (--skip-solid=yes) */
+  const char* accel_spec; /* the forced rows (--accel-rows=), NULL for row ny - 2 only */
+  uint8_t* accel_rows; /* accel_rows[jj] is 1 if local row jj is forced, jj = 1 - halo..local_ny + halo */
+  int   accel_local;  /* no. of forced rows in this rank's slab, 0 skips accelerate_flow() */
+  int   accel_fold;   /* the two-grid kernels force their rows for the next timestep as they write them */
+  int   accel_done;   /* 1 if the grid has already had this timestep's forcing (folded in by the last one) */
+  float solid_tiles;  /* fraction of the tiles of every rank's slab that are solid */
+  int   av_ring;      /* no. of av_vels entries, timestep tt is at tt % av_ring: maxIters, or fewer with --av-vels=stream */
+  MPI_Comm comm;      /* the ranks sharing this grid (MPI_COMM_WORLD or an --ensemble-groups group),
+                      ** as a periodic Cartesian process grid once initialise() has made it */
+  const char* final_state_file; /* outputs, FINALSTATEFILE and AVVELSFILE outside an ensemble */
+  const char* av_vels_file;
+#ifdef POP_REDUCED
+  float pop_ref[NSPEEDS]; /* rest value of each density, the grids hold the deviation from it */
+#endif
+#ifdef AA
+  int   aa_swapped;   /* 1 while the grid holds the AA pattern's swapped layout (after even timesteps) */
+#endif
 } t_param;            /* typedef allows referencing without struct keyword */
 
+/* one member of an ensemble (--ensemble=FILE): the parameters it runs with */
+typedef struct
+{
+  float density;      /* density per link */
+  float accel;        /* density redistribution */
+  float omega;        /* relaxation parameter */
+} t_member;
+
+/*
+** grid layout, chosen at compile time:
+** - default: array of structs, the 9 speeds of a cell are contiguous
+** - SOA: struct of arrays, one plane per speed so that the same speed
+**   of neighbouring cells is contiguous and the kernels vectorise across ii,
+**   each row padded to a multiple of ALIGNMENT bytes
+**   (make CFLAGS="-std=c99 -Wall -O3 -DSOA")
+** SPEED(grid, idx, kk) is speed kk of cell idx in either layout
+**
+** x wrap around uses ghost columns, so the kernels pull from fixed offsets:
+** - cell (ii, jj) is at ii + jj*pitch, with pitch >= local_nx + 2
+** - ghost column local_nx of row jj is a copy of column 0, column -1 a copy
+**   of column local_nx - 1 (it lives in the last padding slot of row jj - 1,
+**   or in the GRIDLEAD cells allocated ahead of row 0)
+** - fill_ghost_columns() refreshes them every timestep, and the halo rows
+**   are exchanged together with their ghosts
+** - with more than one process column (--proc-grid) the block only spans
+**   columns col_offset..col_offset + local_nx - 1, and column_exchange()
+**   fills the ghost columns from the blocks west and east instead
+** - the halo is params.halo rows deep on each side, local rows
+**   1 - halo..0 and local_ny + 1..local_ny + halo; rows before row 0 are
+**   allocated ahead of it like the GRIDLEAD cells
+*/
+/*
+** storage of one density, chosen at compile time:
+** - default: float
+** - FP16 or BF16: the deviation from its rest value params.density * w_kk
+**   as a half or a bfloat16, so the 16 bits are spent on the part that
+**   changes; arithmetic stays in float
+**   (make CFLAGS="-std=c99 -Wall -O3 -fopenmp -DFP16")
+** POP_GET(params, p, kk) is density kk held in grid value p, and
+** POP_PUT(params, x, kk) the grid value that holds density x; copies of
+** grid values (ghost columns, halo rows, rebound) need neither
+*/
+#ifdef FP16
+typedef _Float16 t_pop;
+
+#define POP_TO_FLOAT(p)   ((float)(p))
+#define POP_FROM_FLOAT(x) ((t_pop)(x))
+#elif defined(BF16)
+typedef uint16_t t_pop;
+
+/* bfloat16 is the top half of a float */
+static inline float bf16_to_float(const uint16_t p)
+{
+  const uint32_t bits = (uint32_t)p << 16;
+  float x;
+  memcpy(&x, &bits, sizeof(x));
+  return x;
+}
+
+static inline uint16_t bf16_from_float(const float x)
+{
+  uint32_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  bits += 0x7fffu + ((bits >> 16) & 1u); /* round to nearest, ties to even */
+  return (uint16_t)(bits >> 16);
+}
+
+#define POP_TO_FLOAT(p)   bf16_to_float(p)
+#define POP_FROM_FLOAT(x) bf16_from_float(x)
+#else
+typedef float t_pop;
+#endif
+
+#ifdef POP_REDUCED
+#define POP_GET(params, p, kk) (POP_TO_FLOAT(p) + (params).pop_ref[kk])
+#define POP_PUT(params, x, kk) POP_FROM_FLOAT((x) - (params).pop_ref[kk])
+/* halo messages only copy grid values */
+#define MPI_POP                MPI_UINT16_T
+#else
+#define POP_GET(params, p, kk) (p)
+#define POP_PUT(params, x, kk) (x)
+#define MPI_POP                MPI_FLOAT
+#endif
+
+#ifdef SOA
+/* struct to hold the 'speed' planes, all in one aligned block */
+typedef struct
+{
+  t_pop* speeds[NSPEEDS];
+} t_speed;
+
+#define SPEED(grid, idx, kk) ((grid)->speeds[kk][idx])
+
+#ifdef OFFLOAD
+/* device code only sees the block of planes, the t_speed holds host addresses */
+#define GRIDBLOCK(grid)  ((grid)->speeds[0] - GRIDLEAD)
+#define GRIDPLANE(grid)  ((int)((grid)->speeds[1] - (grid)->speeds[0]))
+#define DSPEED(block, plane, idx, kk) ((block)[(kk)*(plane) + GRIDLEAD + (idx)])
+#endif
+#else
 /* struct to hold the 'speed' values */
 typedef struct
 {
-  float speeds[NSPEEDS];
+  t_pop speeds[NSPEEDS];
 } t_speed;
 
+#define SPEED(grid, idx, kk) ((grid)[idx].speeds[kk])
+#endif
+
+/*
+** in-place streaming with the AA pattern (make CFLAGS="... -DAA"):
+** a single grid, no tmp_cells, even and odd timesteps alternate
+** - even: pull from the neighbours (as the two-grid kernels do), collide,
+**   and write each density back to the location it was pulled from, in
+**   the slot of the opposite direction
+** - odd: read the cell's own slots in opposite order, collide, write them
+**   back in natural order
+** After an even timestep density kk of cell (ii, jj) is therefore in slot
+** AA_OPP[kk] of cell (ii + AA_CX[kk], jj + AA_CY[kk]), which can be a
+** ghost column or halo row until the next timestep folds those back.
+** STATE(grid, params, ii, jj, kk) reads density kk of a slab cell in
+** either layout (plain SPEED() without AA).
+*/
+#ifdef AA
+static const int AA_CX[NSPEEDS]  = { 0, 1, 0, -1,  0, 1, -1, -1,  1 };
+static const int AA_CY[NSPEEDS]  = { 0, 0, 1,  0, -1, 1,  1, -1, -1 };
+static const int AA_OPP[NSPEEDS] = { 0, 3, 4,  1,  2, 7,  8,  5,  6 };
+
+#define STATE(grid, params, ii, jj, kk) (*((params).aa_swapped \
+  ? &SPEED(grid, (ii) + AA_CX[kk] + ((jj) + AA_CY[kk])*(params).pitch, AA_OPP[kk]) \
+  : &SPEED(grid, (ii) + (jj)*(params).pitch, kk)))
+#else
+#define STATE(grid, params, ii, jj, kk) SPEED(grid, (ii) + (jj)*(params).pitch, kk)
+#endif
+
+/*
+** one region for the grids, the obstacle mask and the halo buffers, mapped
+** at start-up and unmapped by finalise(): arena_alloc() hands out arrays
+** aligned to ALIGNMENT, each at the next ALIASSKEW offset into a page
+** (contiguous arrays such as the SOA speed planes count once per stream)
+*/
+typedef struct
+{
+  char*  map;         /* the mapping */
+  size_t map_size;    /* its size */
+  char*  base;        /* start of the usable region (map, or rounded up to HUGEPAGE) */
+  size_t size;        /* bytes usable from base */
+  size_t used;        /* bytes handed out */
+  int    streams;     /* ALIASSKEW offsets handed out */
+} t_arena;
+
+/*
+** the blocked cells of a slab and its halo rows, listed row by row: the
+** columns of the blocked cells in local row jj are
+** cols[row_start[jj]..row_start[jj + 1] - 1], for jj = 1 - halo..local_ny + halo
+** - with --skip-solid each row is cut into tiles of TILEWIDTH columns; a
+**   tile whose cells and their neighbours are all blocked is solid, and
+**   is neither relaxed nor rebounded, so the kernels only update columns
+**   span_lo[ss]..span_hi[ss] - 1 of row jj, for the runs of other tiles
+**   ss = span_start[jj]..span_start[jj + 1] - 1, and cols leaves out the
+**   blocked cells of solid tiles (without it each row is one span)
+*/
+typedef struct
+{
+  int* row_start;  /* local_ny + 2*halo + 1 offsets into cols, indexed from 1 - halo */
+  int* cols;       /* column (ii) of each blocked cell that is updated */
+  int  count;      /* no. of blocked cells in the slab (halo rows excluded), listed or not */
+  int* span_start; /* local_ny + 2*halo + 1 offsets into span_lo/span_hi, indexed from 1 - halo */
+  int* span_lo;    /* first column of each span */
+  int* span_hi;    /* one past its last column */
+  int  solid;      /* no. of solid tiles in the slab (halo rows excluded) */
+  int  tiles;      /* no. of tiles in the slab */
+} t_obstacle_list;
+
+/*
+** --av-vels=stream: a background thread on MASTER writes the reduced
+** av. velocities to AVVELSFILE as they arrive, so av_vels only has to
+** hold the last av_ring of them; the main thread publishes each batch,
+** and waits only if the writer falls a whole ring behind
+*/
+typedef struct
+{
+  FILE*        fp;      /* params.av_vels_file, NULL if not streaming */
+  const float* ring;    /* av_vels */
+  int          size;    /* its no. of entries (params.av_ring) */
+  int          done;    /* timesteps reduced into the ring (main thread) */
+  int          written; /* timesteps written to fp (writer thread) */
+  int          stop;    /* no more are coming */
+  pthread_t       thread;
+  pthread_mutex_t lock; /* for done, written and stop */
+  pthread_cond_t  cond; /* signalled when any of them changes */
+} t_av_stream;
+
+/*
+** partial sums for the average velocity, reduced across ranks in batches:
+** each rank records tot_u for `batch` timesteps, then one
+** MPI_Iallreduce sums the whole batch while the next one is filled
+** (double buffered, at most one reduction in flight)
+*/
+typedef struct
+{
+  int    batch;         /* no. of timesteps per reduction (K) */
+  int    half;          /* half of the buffers being filled */
+  int    filled;        /* no. of timesteps recorded in that half */
+  int    first;         /* timestep of its first entry */
+  int    pending;       /* no. of timesteps in the reduction in flight, 0 if none */
+  int    pending_first; /* timestep of its first entry */
+  int    done;          /* av_vels[0..done-1] are reduced (on every rank) */
+  MPI_Comm comm;        /* ranks the sums are reduced over (params.comm) */
+  int    ring;          /* timestep tt goes to av_vels[tt % ring] (params.av_ring) */
+  t_av_stream* stream;  /* writer to hand the reduced batches to, or NULL */
+  float  fluid_cells;   /* tot_cells, the same every timestep */
+  float* partial;       /* this rank's tot_u, two halves of K floats */
+  float* total;         /* the same sums over all ranks */
+  MPI_Request request;  /* reduction in flight */
+} t_av_batch;
+
+/*
+** an asynchronous checkpoint: each rank copies its block into slab and
+** posts non-blocking MPI-IO writes of it to tmp_path; finishing waits
+** for the writes, closes the file and renames it to path, so path
+** always holds the latest complete checkpoint
+*/
+typedef struct
+{
+  const char* path;      /* checkpoint file, NULL if not checkpointing */
+  char   tmp_path[1024]; /* where it is written first */
+  int    pending;        /* 1 while a checkpoint is being written */
+  int    finish_at;      /* timestep it is finished at */
+  int    header[3];      /* nx, ny, iteration (MASTER) */
+  int    nrequests;
+  float* slab;           /* this rank's densities, NSPEEDS per cell */
+  float* series;         /* av_vels[0..iteration-1] read back from the stream (MASTER), or NULL */
+  MPI_File    fh;
+  MPI_Request* requests; /* the block's rows (one if it spans nx), and on MASTER magic, header and av_vels */
+} t_checkpoint;
+
+/*
+** wall-clock time this rank spends in each phase of the main loop, from
+** the monotonic clock: timer_lap() charges the time since the previous
+** lap to one phase, so the phases add up to the whole loop and the cost
+** is one clock read per phase boundary
+*/
+#define PHASE_ACCELERATE  0 /* forcing and ghost columns */
+#define PHASE_COLLIDE     1 /* fused propagate/rebound/collision */
+#define PHASE_HALO        2 /* posting and waiting for the halo exchange */
+#define PHASE_REDUCE      3 /* av. velocity reductions and the convergence test */
+#define PHASE_CHECKPOINT  4 /* copying and writing checkpoints */
+#define NPHASES           5
+
+typedef struct
+{
+  double phase[NPHASES]; /* seconds in each phase */
+  double mark;           /* clock at the last lap */
+} t_timers;
+
+/* a fused collision kernel: updates slab rows jj_start..jj_end from cells into tmp_cells
+** - every cell is relaxed, then the blocked ones in obstacle_list are overwritten by rebound
+** - adds the velocity norms of the rows' fluid cells to *tot_u: collision does not
+**   change a cell's density or velocity, so they are those of the new state */
+typedef int (*t_collision)(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                           const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                           int jj_start, int jj_end, float* tot_u);
+
+/* a kernel specialised for one fixed shape (d2q9-bgk_shapes.h), tables end with kernel == NULL */
+typedef struct
+{
+  int         nx;      /* row width (local_nx) it was built for */
+  float       omega;   /* relaxation parameter it was built for */
+  t_collision kernel;
+} t_shape_kernel;
+
+/*
+** define kernel() as the row loop of row() with local_nx, pitch and omega
+** replaced by constants: the copy of params is made inside the parallel
+** loop, so that the compiler sees them where the row is inlined, and can
+** fold the index arithmetic and drop the remainder loops
+*/
+#define SPECIALISED_KERNEL(kernel, row, NX, OMEGA)                              \
+static int kernel(const t_param params, t_speed* cells, t_speed* tmp_cells,     \
+                  const uint8_t* obstacles, const t_obstacle_list* obstacle_list, \
+                  int jj_start, int jj_end, float* tot_u)                      \
+{                                                                              \
+  float rows_u = 0.f;                                                          \
+                                                                               \
+  _Pragma("omp parallel for schedule(static) reduction(+:rows_u)")             \
+  for (int jj = jj_start; jj <= jj_end; jj++)                                  \
+  {                                                                            \
+    t_param fixed = params;                                                    \
+    fixed.local_nx = (NX);                                                     \
+    fixed.pitch    = GRIDPITCH(NX);                                            \
+    fixed.omega    = (OMEGA);                                                  \
+    rows_u += row(fixed, cells, tmp_cells, obstacles, obstacle_list, jj);      \
+  }                                                                            \
+                                                                               \
+  *tot_u += rows_u;                                                            \
+                                                                               \
+  return EXIT_SUCCESS;                                                         \
+}
+
 /*
 ** function prototypes
 */
@@ -100,37 +543,314 @@ typedef struct
 /* load params, allocate memory, load obstacles & initialise fluid particle densities */
 int initialise(const char* paramfile, const char* obstaclefile,
                t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr_total, int** obstacles_ptr,
-               float** av_vels_ptr, int size, float** send_buff_up,
-               float** send_buff_dn, float** recv_buff_up, float** recv_buff_dn);
+               uint8_t** obstacles_ptr, t_obstacle_list* obstacle_list,
+               float** av_vels_ptr, int rank, int size,
+               t_pop** send_buff_up, t_pop** send_buff_dn,
+               t_pop** recv_buff_up, t_pop** recv_buff_dn, t_arena* arena);
+
+/* the initial state for params->density: every density at rest, in cells (and tmp_cells
+** touched for placement); also done by initialise(), again for each ensemble member */
+int init_cells(t_param* params, t_speed* cells, t_speed* tmp_cells);
+
+/* read an ensemble file, one "density accel omega" line per member, returns the no. of members */
+int read_ensemble(const char* path, t_member** members_ptr);
+
+/* fill the slab and halo rows (1 - halo..local_ny + halo) of obstacles from a text or binary
+** obstacle file, the halo rows with the neighbouring slabs' cells */
+int load_obstacles(const char* obstaclefile, const t_param* params, uint8_t* obstacles);
+int load_obstacles_text(const char* obstaclefile, const t_param* params, uint8_t* obstacles);
+int load_obstacles_binary(const char* obstaclefile, const t_param* params, uint8_t* obstacles);
+
+/*
+** the process grid (collective on params->comm, size ranks): for
+** --proc-grid=auto (proc_rows == 0) pick the proc_rows x proc_cols that
+** exchanges the fewest densities per rank, then replace params->comm by a
+** periodic Cartesian communicator over it, in the same rank order, and set
+** proc_row, proc_col, left, right and this rank's columns (an even split)
+*/
+int setup_proc_grid(t_param* params, int size);
+
+/* split the rows into one contiguous slab per process row of about equal cost,
+** each row costing its fluid cells plus blocked_cost per blocked cell; sets
+** local_ny, row_offset and imbalance */
+int partition_rows(const char* obstaclefile, t_param* params, int rank);
+
+/* params->accel_rows for this rank's slab and halo rows from --accel-rows: "all", or a
+** comma-separated list of rows Y and ranges Y0:Y1 (negative Y counts from ny, -2 being
+** the default row ny - 2); sets accel_local */
+int set_accel_rows(t_param* params);
+
+/* blocked[yy] = no. of blocked cells in global row yy of a text or binary obstacle file */
+int count_blocked_rows(const char* obstaclefile, const t_param* params, int* blocked);
+
+/* list the blocked cells of the slab and halo rows row by row, and the spans of columns
+** outside solid tiles; returns how many blocked cells are in the slab */
+int build_obstacle_list(const t_param* params, const uint8_t* obstacles, t_obstacle_list* obstacle_list);
+/* whether a cell of the mask or the one its ghost column stands for is blocked, for build_obstacle_list() */
+int tile_neighbour_blocked(const t_param* params, const uint8_t* obstacles, int ii, const int jj);
 
 /*
 ** The main calculation methods.
 ** timestep calls, in order, the functions:
-** accelerate_flow(), propagate(), rebound() & collision()
+** accelerate_flow(), halo_start(), collision() (interior rows),
+** halo_finish() & collision() (edge rows)
+** collision() fuses propagate, rebound and collision into a single
+** pass that pulls from cells and writes the new state into tmp_cells;
+** the caller swaps the two pointers afterwards
+** the same pass leaves this rank's sum of velocity norms of the new
+** state in *tot_u, so there is no separate av_velocity() pass
+** the timestep functions charge their phases to *timers as they go
+*/
+int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+             const t_obstacle_list* obstacle_list,
+             int up, int dn, t_pop* send_buff_up, t_pop* send_buff_dn,
+             t_pop* recv_buff_up, t_pop* recv_buff_dn, t_collision collide, float* tot_u,
+             t_timers* timers);
+
+/*
+** temporal blocking (--tb-depth=K, two-grid builds): advance the slab by
+** depth <= params.halo timesteps with one halo exchange, in a wavefront
+** over the rows, and record this rank's tot_u of each of them in tot_u[];
+** the new state ends up in tmp_cells if depth is odd, in cells if it is even
+*/
+int timestep_blocked(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                     const t_obstacle_list* obstacle_list, const int depth,
+                     int up, int dn, t_pop* send_buff_up, t_pop* send_buff_dn,
+                     t_pop* recv_buff_up, t_pop* recv_buff_dn, t_collision collide,
+                     float* tot_u, t_timers* timers);
+
+int accelerate_flow(const t_param params, t_speed* cells, uint8_t* obstacles);
+/* accelerate_flow() for local row jj, whichever slab or halo row it is */
+static inline void accelerate_row(const t_param params, t_speed* cells, const uint8_t* obstacles,
+                                  const int jj);
+/* copy columns 0 and local_nx - 1 of the slab rows into the ghost columns */
+int fill_ghost_columns(const t_param params, t_speed* cells);
+static inline void fill_ghost_row(const t_param params, t_speed* cells, const int jj);
+/* the same from the blocks west and east when --proc-grid splits the columns: slots
+** 1, 5, 8 of ghost column -1 and 3, 6, 7 of ghost column local_nx, which are all the
+** pulls read; it completes before halo_start(), so the halo rows carry the ghost
+** columns on to the diagonal neighbours' corners */
+int column_exchange(const t_param params, t_speed* cells, t_pop* send_buff_w, t_pop* send_buff_e,
+                    t_pop* recv_buff_w, t_pop* recv_buff_e);
+/* exchange params.halo rows with each neighbour: all densities of deep halos (they are
+** updated redundantly), only the three crossing into the slab of one-row halos */
+int halo_start(const t_param params, t_speed* cells, int up, int dn,
+               t_pop* send_buff_up, t_pop* send_buff_dn,
+               t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests);
+int halo_finish(const t_param params, t_speed* cells,
+                t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests);
+/* BGK collision of one cell's (already propagated) densities, in place; returns its |u| */
+#ifdef OFFLOAD
+#pragma omp declare target
+#endif
+static inline float relax_speeds(const t_param params, float speeds[NSPEEDS]);
+#ifdef OFFLOAD
+#pragma omp end declare target
+#endif
+/* fused propagate/collision for cell (ii, jj), shared by all collision kernels; returns its |u| */
+static inline float collision_cell(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                  const int ii, const int jj);
+/* propagate/rebound for the blocked cells of row jj, overwriting what the kernel relaxed there */
+static inline void rebound_row(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                               const t_obstacle_list* obstacle_list, const int jj);
+/* 1 if row jj is a single span of all its columns, i.e. has no solid tiles */
+static inline int row_unbroken(const t_param params, const t_obstacle_list* obstacle_list, const int jj);
+/* relax columns lo..hi - 1 of row jj as if fluid, returns the velocity norms of the fluid ones */
+static inline float collision_span(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                   const uint8_t* obstacles, const int jj, const int lo, const int hi);
+/* update of row jj by the scalar kernel, collision() shares the rows out;
+** returns the velocity norms of the row's fluid cells */
+static inline float collision_row(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                  const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                                  const int jj);
+int collision(const t_param params, t_speed* cells, t_speed* tmp_cells,
+              const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+              int jj_start, int jj_end, float* tot_u);
+#ifdef AA
+/* AA pattern kernels, in place on cells (tmp_cells is unused); blocked cells are left alone,
+** since rebound is the identity on them in both layouts */
+int collision_aa_even(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                      const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                      int jj_start, int jj_end, float* tot_u);
+int collision_aa_odd(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                     const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                     int jj_start, int jj_end, float* tot_u);
+/* odd timesteps: move what the even one wrote into ghost columns and halo rows to its owners */
+int fold_ghost_columns(const t_param params, t_speed* cells);
+int halo_return_start(const t_param params, t_speed* cells, int up, int dn,
+                      t_pop* send_buff_up, t_pop* send_buff_dn,
+                      t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests);
+int halo_return_finish(const t_param params, t_speed* cells,
+                       t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests);
+#endif
+#ifdef OFFLOAD
+/*
+** device offload (make CFLAGS="... -DOFFLOAD" plus the compiler's offload
+** flags): offload_enter() maps the grids, obstacle mask, halo buffers and
+** the av. velocity sums to this rank's device, where they stay until
+** offload_exit() brings the final state back
+** - timestep_offload() is timestep() with every step on the device; the
+**   halo rows are packed and unpacked there, and MPI is handed device
+**   addresses (GPU-aware MPI), or with -DOFFLOAD_HOST_MPI the buffers
+**   are staged through the host
+** - the collision kernel leaves each row's velocity norms in row_u[jj],
+**   av_velocity_offload() sums them into tot_u_dev[slot], on the device
+*/
+int offload_enter(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                  t_pop* send_buff_up, t_pop* send_buff_dn, t_pop* recv_buff_up, t_pop* recv_buff_dn,
+                  float* row_u, float* tot_u_dev, const int batch);
+int offload_exit(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                 t_pop* send_buff_up, t_pop* send_buff_dn, t_pop* recv_buff_up, t_pop* recv_buff_dn,
+                 float* row_u, float* tot_u_dev, const int batch);
+int timestep_offload(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                     int up, int dn, t_pop* send_buff_up, t_pop* send_buff_dn,
+                     t_pop* recv_buff_up, t_pop* recv_buff_dn, float* row_u,
+                     t_timers* timers);
+int accelerate_flow_offload(const t_param params, t_speed* cells, uint8_t* obstacles);
+int fill_ghost_columns_offload(const t_param params, t_speed* cells);
+/* rows jj_start..jj_end, queued with nowait: the host carries on until a taskwait */
+int collision_offload(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                      int jj_start, int jj_end, float* row_u);
+int av_velocity_offload(const t_param params, float* row_u, float* tot_u_dev, const int slot);
+/* copy tot_u_dev[0..*slot-1] back and push them into av */
+int av_batch_push_offload(t_av_batch* av, float* av_vels, float* tot_u_dev, int* slot);
+/* copy the state back for a checkpoint */
+int offload_update_host(const t_param params, t_speed* cells);
+#endif
+
+/*
+** pick the collision kernel once at start-up:
+** isa is "auto" (widest instruction set the host supports), "scalar",
+** or, in SIMD builds, "avx2", "avx512" or "neon"; unless specialise is 0
+** the copy built for params' shape is used, if there is one
 */
-int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
+t_collision select_collision(const t_param params, const char* isa, const int specialise,
+                             const char** name);
+/* the entry of a table of specialised kernels that matches params, or generic */
+t_collision find_shape_kernel(const t_param params, const t_shape_kernel* shapes,
+                              t_collision generic);
+
+/* compute average velocity (reduced across all ranks) */
+float av_velocity(const t_param params, t_speed* cells, uint8_t* obstacles);
+
+/* accumulate this rank's velocity norms and no. of fluid cells */
+int av_velocity_partial(const t_param params, t_speed* cells, uint8_t* obstacles,
+                        float* tot_u_ptr);
+/* the velocity norms of the fluid cells in local row jj */
+static inline float av_velocity_row(const t_param params, t_speed* cells, uint8_t* obstacles,
+                                    const int jj);
+
+/* batched reduction of the partial sums into av_vels (same series on every rank) */
+int av_batch_init(t_av_batch* av, const int batch, const int fluid_cells, const int first,
+                  const int ring, t_av_stream* stream, const MPI_Comm comm);
+int av_batch_push(t_av_batch* av, float* av_vels, const float tot_u);
+int av_batch_post(t_av_batch* av, float* av_vels);
+int av_batch_wait(t_av_batch* av, float* av_vels);
+int av_batch_flush(t_av_batch* av, float* av_vels);
+int av_batch_free(t_av_batch* av);
+/* 1 if the next av_batch_push() completes a reduction, i.e. av->done grows */
+int av_batch_completes(const t_av_batch* av);
 
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells);
-int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles);
+/*
+** --av-vels=stream (MASTER): av_stream_open() truncates path and
+** starts the writer on ring (size entries) at timestep 0; publish hands
+** it av_vels[..done-1], reserve waits until av_vels[..end-1] can be
+** stored without overwriting unwritten entries, sync until everything
+** published is in the file, and close writes the rest and stops it
+*/
+int av_stream_open(t_av_stream* stream, const char* path, const float* ring, const int size);
+int av_stream_publish(t_av_stream* stream, const int done);
+int av_stream_reserve(t_av_stream* stream, const int end);
+int av_stream_sync(t_av_stream* stream);
+int av_stream_close(t_av_stream* stream);
+void* av_stream_writer(void* arg);
+/* read the first n av. velocities of an AVVELSFILE back into av */
+int av_vels_read(const char* path, const int n, float* av);
 
-/* compute average velocity */
-float av_velocity(const t_param params, t_speed* cells, int* obstacles);
+/*
+** steady state (--converge=TOL): 1 if the last window values of
+** av_vels[0..done-1] vary by less than tolerance relative to the latest,
+** i.e. (max - min) / |av_vels[done-1]| < tolerance; av_vels is the same
+** on every rank, so they all stop at the same timestep (timestep tt is
+** at av_vels[tt % ring], and window must not exceed ring)
+*/
+int av_converged(const float* av_vels, const int ring, const int done, const int window, const float tolerance);
 
 /* Sum all the densities in the grid.
 ** The total should remain constant from one timestep to the next. */
 float total_density(const t_param params, t_speed* cells);
 
 /* calculate Reynolds number */
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles);
+float calc_reynolds(const t_param params, t_speed* cells, uint8_t* obstacles);
+
+/* velocity, pressure and obstacle flag of local cell (ii, jj), as the final state has them */
+static inline void cell_state(const t_param params, t_speed* cells, uint8_t* obstacles,
+                              const int ii, const int jj, t_state_record* record);
+
+/* write the final state (collectively, text or binary) and, on MASTER, the av_vels
+** series (unless it is NULL, i.e. it was streamed) */
+int write_values(const t_param params, t_speed* cells, uint8_t* obstacles, float* av_vels,
+                 const int rank, const int binary);
+
+/*
+** compare the final state and av_vels with reference results as check/check.py
+** does, with the same tolerance (%) semantics, without writing or parsing text:
+** each rank reads its own rows of a binary reference final state (either
+** reference may be NULL); collective, returns 1 if either check failed
+*/
+int check_values(const t_param params, t_speed* cells, uint8_t* obstacles, float* av_vels,
+                 const char* ref_av_vels, const char* ref_final_state, const double tolerance,
+                 const int rank);
+
+/*
+** checkpoint/restart (collective): checkpoint_start() copies the state
+** after iteration timesteps plus av_vels[0..iteration-1] (which must be
+** reduced) and returns once the writes are posted, checkpoint_finish()
+** completes them; restart() loads a checkpoint into cells (natural layout)
+** and av_vels, whatever no. of ranks wrote it, and returns its iteration
+** - with a stream (MASTER, --av-vels=stream) the series is read back from
+**   params.av_vels_file for the checkpoint, and on restart replayed into it, one
+**   ring of av_vels at a time
+*/
+int checkpoint_init(t_checkpoint* ckpt, const char* path, const t_param params);
+int checkpoint_start(t_checkpoint* ckpt, const t_param params, t_speed* cells, float* av_vels,
+                     t_av_stream* stream, const int iteration, const int rank);
+int checkpoint_finish(t_checkpoint* ckpt, const int rank);
+int checkpoint_free(t_checkpoint* ckpt);
+int restart(const char* path, const t_param params, t_speed* cells, float* av_vels,
+            t_av_stream* stream);
+
+/* seconds on the monotonic clock */
+static inline double wtime(void);
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels);
+/* start the timers / charge the time since the last lap to phase */
+void timer_start(t_timers* timers);
+static inline void timer_lap(t_timers* timers, const int phase);
+
+/*
+** report the phase times (min / mean / max over ranks), MLUPS and the
+** memory bandwidth they imply for iterations timesteps in elapsed seconds,
+** and if json_path is set write them all, per rank too, to that file (collective)
+*/
+int report_timings(const t_param params, const t_timers* timers, const int iterations,
+                   const double elapsed, const char* isa_name, const char* json_path,
+                   const int rank, const int size);
 
 /* finalise, including freeing up allocated memory */
 int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr);
+             uint8_t** obstacles_ptr, t_obstacle_list* obstacle_list, float** av_vels_ptr,
+             t_arena* arena);
+
+/* map an arena of at least bytes (--huge-pages: THP backed), allocate from it, unmap it */
+int arena_init(t_arena* arena, const size_t bytes, const int huge_pages);
+void* arena_alloc(t_arena* arena, const size_t bytes, const int streams);
+int arena_free(t_arena* arena);
+
+/* allocate a grid of the slab and halo rows in the compiled layout from the arena
+** (row 0 is params->halo - 1 rows into the allocation); grid_bytes() is the most
+** arena it takes */
+t_speed* alloc_grid(const t_param* params, t_arena* arena);
+size_t grid_bytes(const t_param* params);
 
 /* utility functions */
 void die(const char* message, const int line, const char* file);
@@ -144,11 +864,62 @@ int main(int argc, char* argv[])
 {
   char*    paramfile = NULL;    /* name of the input parameter file */
   char*    obstaclefile = NULL; /* name of a the input obstacle file */
+  const char* isa = "auto";     /* instruction set for the collision kernel (--isa=) */
+  const char* isa_name = NULL;  /* the one actually picked */
+  t_collision collide = NULL;   /* collision kernel for that instruction set */
   t_param  params;              /* struct to hold parameter values */
   t_speed* cells     = NULL;    /* grid containing fluid densities */
   t_speed* tmp_cells = NULL;    /* scratch space */
-  int*     obstacles = NULL;    /* grid indicating which cells are blocked (local) */
+  uint8_t* obstacles = NULL;    /* grid indicating which cells are blocked (local) */
+  t_obstacle_list obstacle_list; /* the same cells, listed row by row */
   float* av_vels     = NULL;    /* a record of the av. velocity computed for each timestep */
+  int av_batch_size  = AVBATCH; /* timesteps per av. velocity reduction (--av-batch=) */
+  t_av_batch av_batch;          /* partial av. velocity sums awaiting reduction */
+  int binary_output = 0;        /* final state format (--output-format=text|binary) */
+  int tb_depth = 1;             /* timesteps per halo exchange (--tb-depth=), 1 is no temporal blocking */
+  int specialise = 1;           /* use a kernel built for the shape, if any (--specialise=yes|no) */
+  float* tb_tot_u = NULL;       /* tot_u of each timestep of a block */
+  float converge_tol = 0.f;     /* stop at a steady state (--converge=), 0 runs all maxIters */
+  int converge_window = 1000;   /* timesteps it is measured over (--converge-window=) */
+  int converge_done;            /* av_vels reduced when it was last checked */
+  int converged = 0;            /* stopped before maxIters */
+  const char* checkpoint_path = NULL; /* checkpoint file (--checkpoint=) */
+  int checkpoint_every = 1000;  /* timesteps between checkpoints (--checkpoint-every=) */
+  int checkpoint_next;          /* timestep of the next one */
+  t_checkpoint checkpoint;      /* the one being written */
+  const char* restart_path = NULL; /* checkpoint to resume from (--restart=) */
+  int start = 0;                /* timesteps done before this run */
+  float blocked_cost = BLOCKEDCOST; /* partitioner weight of a blocked cell (--blocked-cost=) */
+  t_timers timers;              /* this rank's time in each phase of the main loop */
+  const char* timings_path = NULL; /* also write the timings as JSON (--timings=) */
+  const char* check_av_vels = NULL;     /* reference results to compare with (--check-av-vels=) */
+  const char* check_final_state = NULL; /* (--check-final-state=, binary) */
+  double check_tolerance = 1.0; /* % difference allowed (--check-tolerance=) */
+  int check_failed = 0;         /* the run did not match them */
+  int stream_av_vels = 0;       /* write av_vels.dat during the run (--av-vels=memory|stream) */
+  t_av_stream av_stream;        /* its writer thread (MASTER) */
+  t_av_stream* stream = NULL;   /* &av_stream where there is one */
+  float* series;                /* the whole av_vels series, for --check-av-vels */
+  const char* ensemble_path = NULL; /* parameter sets to run in turn (--ensemble=FILE) */
+  int ensemble_groups = 1;      /* groups of ranks running members at the same time (--ensemble-groups=) */
+  t_member* members = NULL;     /* the ensemble, NULL to run the parameter file once */
+  int nmembers = 1;             /* its no. of members */
+  int group = 0;                /* this rank's group */
+  int max_iters;                /* maxIters from the parameter file, for each member */
+  char final_state_file[64];    /* this member's output files */
+  char av_vels_file[64];
+  int huge_pages = 0;           /* back the grids with huge pages (--huge-pages=yes|no) */
+  int skip_solid = 1;           /* leave out the solid tiles (--skip-solid=yes|no) */
+  const char* accel_spec = NULL; /* forced rows (--accel-rows=LIST|all) */
+  int grid_rows = -1;           /* process grid (--proc-grid=rows|auto|RxC), -1 is one row per rank */
+  int grid_cols = 1;            /* and 0 x 0 auto */
+  char grid_extra;              /* anything after RxC */
+  t_arena arena;                /* the grids, obstacle mask and halo buffers */
+  #ifdef OFFLOAD
+  float* row_u     = NULL;        /* per row av. velocity sums, on the device */
+  float* tot_u_dev = NULL;        /* tot_u of each timestep of a batch, on the device */
+  int    av_slot   = 0;           /* no. of those not yet copied back */
+  #endif
   struct timeval timstr;        /* structure to hold elapsed time */
   struct rusage ru;             /* structure to hold CPU time--system and user */
   double tic, toc;              /* floating point numbers to calculate elapsed wallclock time */
@@ -157,21 +928,21 @@ int main(int argc, char* argv[])
 
   /* MPI vars */
   int flag;         /* for checking whether MPI_Init() has been called */
+  int provided;     /* level of thread support provided by MPI */
   int rank;         /* 'rank' of process among it's cohort */ 
   int size;         /* size of cohort, i.e. num processes started */
   int up;           /* rank of process above current one */
   int dn;           /* rank of process below current one */
-  int* obstacles_total = NULL;  /* grid indicating which cells are blocked (total) */
-  float* send_buff_up  = NULL;  /* send/receive buffers for halo exchange */
-  float* send_buff_dn  = NULL;
-  float* recv_buff_up  = NULL;
-  float* recv_buff_dn  = NULL;
+  t_pop* send_buff_up  = NULL;  /* send/receive buffers for halo exchange */
+  t_pop* send_buff_dn  = NULL;
+  t_pop* recv_buff_up  = NULL;
+  t_pop* recv_buff_dn  = NULL;
 
   /* MPI constants */
   #define MASTER 0
 
   /* parse the command line */
-  if (argc != 3)
+  if (argc < 3)
   {
     usage(argv[0]);
   }
@@ -181,10 +952,50 @@ int main(int argc, char* argv[])
     obstaclefile = argv[2];
   }
 
+  /* optional --name=value arguments */
+  for (int aa = 3; aa < argc; aa++)
+  {
+    if (strncmp(argv[aa], "--isa=", 6) == 0) isa = argv[aa] + 6;
+    else if (strncmp(argv[aa], "--av-batch=", 11) == 0) av_batch_size = atoi(argv[aa] + 11);
+    else if (strncmp(argv[aa], "--tb-depth=", 11) == 0) tb_depth = atoi(argv[aa] + 11);
+    else if (strncmp(argv[aa], "--converge=", 11) == 0) converge_tol = (float)atof(argv[aa] + 11);
+    else if (strncmp(argv[aa], "--converge-window=", 18) == 0) converge_window = atoi(argv[aa] + 18);
+    else if (strncmp(argv[aa], "--checkpoint=", 13) == 0) checkpoint_path = argv[aa] + 13;
+    else if (strncmp(argv[aa], "--checkpoint-every=", 19) == 0) checkpoint_every = atoi(argv[aa] + 19);
+    else if (strncmp(argv[aa], "--restart=", 10) == 0) restart_path = argv[aa] + 10;
+    else if (strncmp(argv[aa], "--blocked-cost=", 15) == 0) blocked_cost = (float)atof(argv[aa] + 15);
+    else if (strncmp(argv[aa], "--timings=", 10) == 0) timings_path = argv[aa] + 10;
+    else if (strncmp(argv[aa], "--check-av-vels=", 16) == 0) check_av_vels = argv[aa] + 16;
+    else if (strncmp(argv[aa], "--check-final-state=", 20) == 0) check_final_state = argv[aa] + 20;
+    else if (strncmp(argv[aa], "--check-tolerance=", 18) == 0) check_tolerance = atof(argv[aa] + 18);
+    else if (strcmp(argv[aa], "--specialise=yes") == 0) specialise = 1;
+    else if (strcmp(argv[aa], "--specialise=no") == 0) specialise = 0;
+    else if (strcmp(argv[aa], "--output-format=text") == 0) binary_output = 0;
+    else if (strcmp(argv[aa], "--output-format=binary") == 0) binary_output = 1;
+    else if (strcmp(argv[aa], "--av-vels=memory") == 0) stream_av_vels = 0;
+    else if (strcmp(argv[aa], "--av-vels=stream") == 0) stream_av_vels = 1;
+    else if (strcmp(argv[aa], "--huge-pages=yes") == 0) huge_pages = 1;
+    else if (strcmp(argv[aa], "--huge-pages=no") == 0) huge_pages = 0;
+    else if (strcmp(argv[aa], "--skip-solid=yes") == 0) skip_solid = 1;
+    else if (strcmp(argv[aa], "--skip-solid=no") == 0) skip_solid = 0;
+    else if (strncmp(argv[aa], "--accel-rows=", 13) == 0) accel_spec = argv[aa] + 13;
+    else if (strncmp(argv[aa], "--ensemble=", 11) == 0) ensemble_path = argv[aa] + 11;
+    else if (strncmp(argv[aa], "--ensemble-groups=", 18) == 0) ensemble_groups = atoi(argv[aa] + 18);
+    else if (strcmp(argv[aa], "--proc-grid=rows") == 0) { grid_rows = -1; grid_cols = 1; }
+    else if (strcmp(argv[aa], "--proc-grid=auto") == 0) { grid_rows = 0; grid_cols = 0; }
+    else if (strncmp(argv[aa], "--proc-grid=", 12) == 0)
+    {
+      if (sscanf(argv[aa] + 12, "%dx%d%c", &grid_rows, &grid_cols, &grid_extra) != 2
+          || grid_rows < 1 || grid_cols < 1) usage(argv[0]);
+    }
+    else usage(argv[0]);
+  }
+
   /* Initialise our MPI environment */
-  MPI_Init(&argc, &argv);
+  /* OpenMP threads only compute, MPI calls stay on the master thread */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   MPI_Initialized(&flag);
-  if (flag != 1) {
+  if (flag != 1 || provided < MPI_THREAD_FUNNELED) {
     MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   }
 
@@ -198,155 +1009,416 @@ int main(int argc, char* argv[])
   /* determine the RANK of the current process [0:SIZE-1] */
   MPI_Comm_rank( MPI_COMM_WORLD, &rank );
 
-  /* initialise our data structures and load values from file */
+  params.comm = MPI_COMM_WORLD;
+
+  /*
+  ** ensemble: the members are dealt out to groups of consecutive ranks,
+  ** each group splits the grid between its own ranks and runs its members
+  ** one after another on the same geometry; from here on rank and size
+  ** are those within the group
+  */
+  if (ensemble_path != NULL)
+  {
+    if (ensemble_groups < 1 || ensemble_groups > size)
+    {
+      die("--ensemble-groups must be between 1 and the no. of ranks", __LINE__, __FILE__);
+    }
+
+    if (checkpoint_path != NULL || restart_path != NULL || timings_path != NULL
+        || check_av_vels != NULL || check_final_state != NULL)
+    {
+      die("--checkpoint, --restart, --timings and --check-* are for single runs, not --ensemble", __LINE__, __FILE__);
+    }
+
+    nmembers = read_ensemble(ensemble_path, &members);
+    group = rank * ensemble_groups / size;
+
+    MPI_Comm_split(MPI_COMM_WORLD, group, rank, &params.comm);
+    MPI_Comm_size(params.comm, &size);
+    MPI_Comm_rank(params.comm, &rank);
+  }
+  else if (ensemble_groups != 1)
+  {
+    die("--ensemble-groups needs --ensemble", __LINE__, __FILE__);
+  }
+
+  if (tb_depth < 1) die("--tb-depth must be at least 1", __LINE__, __FILE__);
+  #ifdef AA
+  if (tb_depth > 1) die("--tb-depth needs the two-grid build (no -DAA)", __LINE__, __FILE__);
+  #endif
+  #ifdef OFFLOAD
+  if (tb_depth > 1) die("--tb-depth is not supported by the -DOFFLOAD build", __LINE__, __FILE__);
+  #endif
+
+  /* initialise our data structures and load values from file
+  ** (the halo depth sizes the grids and with the blocked cost
+  ** decides the partition, so they are set first) */
+  params.halo = tb_depth;
+  params.blocked_cost = blocked_cost;
+  params.huge_pages = huge_pages;
+  params.skip_solid = skip_solid;
+  params.accel_spec = accel_spec;
+  params.accel_fold = 0;
+  params.proc_rows  = (grid_rows < 0) ? size : grid_rows;
+  params.proc_cols  = grid_cols;
+  /* streamed, av_vels holds enough for the convergence window and a batch
+  ** in flight (initialise() caps it at maxIters, 0 keeps every entry) */
+  params.av_ring = 0;
+
+  if (stream_av_vels)
+  {
+    params.av_ring = AVSTREAMRING;
+    if (params.av_ring < converge_window) params.av_ring = converge_window;
+    if (params.av_ring < av_batch_size) params.av_ring = av_batch_size;
+  }
   initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells,
-             &obstacles_total, &obstacles, &av_vels, size, &send_buff_up,
-             &send_buff_dn, &recv_buff_up, &recv_buff_dn);
+             &obstacles, &obstacle_list, &av_vels, rank, size, &send_buff_up,
+             &send_buff_dn, &recv_buff_up, &recv_buff_dn, &arena);
 
-  printf("\n\n\nINITIALISATION SUCCESSFUL\n\n\n");
+  max_iters = params.maxIters;
+  params.final_state_file = FINALSTATEFILE;
+  params.av_vels_file     = AVVELSFILE;
 
   /*
   ** determine process ranks above and below this rank
-  ** respecting periodic boundary conditions (rank + size -1 wrap around to bottom rank)
+  ** respecting periodic boundary conditions: the process grid wraps
+  ** around, so with one column these are rank - 1 and rank + 1 mod size
   */
-  up = (rank == MASTER) ? (rank + size - 1) : (rank - 1);
-  dn = (rank + 1) % size;
+  MPI_Cart_shift(params.comm, 0, 1, &up, &dn);
   #ifdef DEBUG_ranks_updn
   printf("Rank: %d Above: %d Below: %d\n", rank, up, dn);
   #endif
 
-  /* determine local grid size??? */
+  #ifdef OFFLOAD
+  /* the device has a kernel of its own (built for any shape) */
+  if (strcmp(isa, "auto") != 0) die("--isa is not supported by the -DOFFLOAD build", __LINE__, __FILE__);
+  (void)specialise;
+  isa_name = "OpenMP target offload";
+  #endif
+
+  if (av_batch_size < 1) die("--av-batch must be at least 1", __LINE__, __FILE__);
+  if (converge_tol < 0.f) die("--converge must not be negative", __LINE__, __FILE__);
+  if (converge_window < 2) die("--converge-window must be at least 2", __LINE__, __FILE__);
+  if (checkpoint_every < 1) die("--checkpoint-every must be at least 1", __LINE__, __FILE__);
 
   printf("\n\n\nINITIALISATION SUCCESSFUL\n\n\n");
 
-  /* begin timing pre-execution */
-  gettimeofday(&timstr, NULL);
-  tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-
-  /* iterate for maxIters timesteps */
-  /* --------------------------------- MAIN LOOP --------------------------------- */
-  for (int tt = 0; tt < params.maxIters; tt++)
-  {
-    if (tt == 0) {
-      #ifdef DEBUG_state_timestep
-      int aa, bb, cc, dd, ee, ff, gg, hh, ii, jj;
-      int local_ny = params.ny / size;
-      int count0 = 0;
-
-      printf("Params: %d %d %d %d %.4f %.4f %.4f\n", params.nx, params.ny, params.maxIters,
-      params.reynolds_dim, params.density, params.accel, params.omega);
-
-      printf("Printing main grid:\n");
-      for (aa = 0; aa < local_ny+2; aa++) {
-        printf("\nRow %d\n", aa+1);
-        for (bb = 0; bb < params.nx; bb++) {
-          for (int cc = 0; cc < 9; cc++) {
-            printf("%.2f ", cells[bb + aa].speeds[cc]);
-            count0++;
-          }
+  /* one run of the parameter file, or this group's ensemble members */
+  for (int mm = group; mm < nmembers; mm += ensemble_groups)
+  {
+    /* the geometry, partition and grids are kept, the state starts over */
+    if (members != NULL)
+    {
+      params.density  = members[mm].density;
+      params.accel    = members[mm].accel;
+      params.omega    = members[mm].omega;
+      params.maxIters = max_iters;
+      converged       = 0;
+
+      sprintf(final_state_file, MEMBERFINALSTATEFILE, mm);
+      sprintf(av_vels_file, MEMBERAVVELSFILE, mm);
+      params.final_state_file = final_state_file;
+      params.av_vels_file     = av_vels_file;
+
+      init_cells(&params, cells, tmp_cells);
+    }
+
+    #ifndef OFFLOAD
+    /* a specialised kernel is built for one omega */
+    collide = select_collision(params, isa, specialise, &isa_name);
+    #endif
+
+    /* MASTER's writer starts at timestep 0, a restart replays the series so far into it */
+    if (stream_av_vels && rank == MASTER)
+    {
+      stream = &av_stream;
+      av_stream_open(stream, params.av_vels_file, av_vels, params.av_ring);
+    }
+
+    /* resume: the state and av_vels so far, the series carries on from there */
+    if (restart_path != NULL) start = restart(restart_path, params, cells, av_vels, stream);
+
+    av_batch_init(&av_batch, av_batch_size, params.fluid_cells, start, params.av_ring, stream,
+                  params.comm);
+    checkpoint_init(&checkpoint, checkpoint_path, params);
+    checkpoint_next = start + checkpoint_every;
+    converge_done   = start;
+
+    tb_tot_u = (float*)malloc(sizeof(float) * tb_depth);
+
+    if (tb_tot_u == NULL) die("cannot allocate memory for tot_u", __LINE__, __FILE__);
+
+    #ifdef OFFLOAD
+    row_u     = (float*)malloc(sizeof(float) * (params.local_ny + 2));
+    tot_u_dev = (float*)malloc(sizeof(float) * av_batch_size);
+
+    if (row_u == NULL || tot_u_dev == NULL) die("cannot allocate memory for tot_u", __LINE__, __FILE__);
+
+    /* the grids live on the device from here to the end of the main loop */
+    offload_enter(params, cells, tmp_cells, obstacles, send_buff_up, send_buff_dn,
+                  recv_buff_up, recv_buff_dn, row_u, tot_u_dev, av_batch_size);
+    #endif
+
+    /* begin timing pre-execution */
+    gettimeofday(&timstr, NULL);
+    tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+    timer_start(&timers);
+
+    /* iterate for maxIters timesteps */
+    /* --------------------------------- MAIN LOOP --------------------------------- */
+    for (int tt = start; tt < params.maxIters; tt++)
+    {
+      /*
+      ** steady state: the test only sees batches that have been reduced, so
+      ** it lags up to two batches (--av-batch) behind; the run stops here,
+      ** after tt timesteps, all of which are in av_vels
+      */
+      if (converge_tol > 0.f && av_batch.done > converge_done)
+      {
+        converge_done = av_batch.done;
+
+        if (av_converged(av_vels, params.av_ring, converge_done, converge_window, converge_tol))
+        {
+          params.maxIters = tt;
+          converged = 1;
+          break;
         }
-        printf("%1cRow length: %d\n", ' ', bb);
+
+        timer_lap(&timers, PHASE_REDUCE);
       }
-      printf("Main grid length: %d\n", count0);
-
-      count0 = 0;
-      printf("Printing helper grid:\n");
-      for (dd = 0; dd < local_ny+2; dd++) {
-        printf("\nRow %d\n", dd+1);
-        for (ee = 0; ee < params.nx; ee++) {
-          for (ff = 0; ff < 9; ff++) {
-            printf("%.2f", tmp_cells[ee + dd].speeds[ff]);
-            count0++;
-          }
-        }
-        printf("%1cRow length: %d\n", ' ', ee);
+
+      /*
+      ** checkpoint: av_vels must be complete up to here, so the batch so far
+      ** is reduced early (AA builds wait for a timestep that leaves the
+      ** natural layout); the write is left CHECKPOINTLAG timesteps to finish
+      */
+      if (checkpoint.pending && tt >= checkpoint.finish_at) checkpoint_finish(&checkpoint, rank);
+
+      #ifdef AA
+      if (checkpoint.path != NULL && tt >= checkpoint_next && !params.aa_swapped)
+      #else
+      if (checkpoint.path != NULL && tt >= checkpoint_next)
+      #endif
+      {
+        #ifdef OFFLOAD
+        av_batch_push_offload(&av_batch, av_vels, tot_u_dev, &av_slot);
+        offload_update_host(params, cells);
+        #endif
+        av_batch_flush(&av_batch, av_vels);
+        checkpoint_start(&checkpoint, params, cells, av_vels, stream, tt, rank);
+        checkpoint_next = tt + checkpoint_every;
       }
-      printf("Helper grid length: %d\n", count0);
-
-      count0 = 0;
-      printf("Printing total obstacles:\n");
-      for (gg = 0; gg < params.ny; gg++) {
-        printf("\nRow %d\n", gg+1);
-        for (hh = 0; hh < params.nx; hh++) {
-          printf("%d", obstacles_total[hh + gg]);
-          count0++;
+
+      if (checkpoint.path != NULL) timer_lap(&timers, PHASE_CHECKPOINT);
+
+      /* temporal blocking: up to tb_depth timesteps per pass over the grid */
+      if (tb_depth > 1)
+      {
+        const int depth = (params.maxIters - tt < tb_depth) ? params.maxIters - tt : tb_depth;
+
+        timestep_blocked(params, cells, tmp_cells, obstacles, &obstacle_list, depth, up, dn,
+                         send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn, collide, tb_tot_u,
+                         &timers);
+
+        if (depth % 2 == 1)
+        {
+          t_speed* cells_swap = cells;
+          cells     = tmp_cells;
+          tmp_cells = cells_swap;
+        }
+
+        for (int ss = 0; ss < depth; ss++)
+        {
+          av_batch_push(&av_batch, av_vels, tb_tot_u[ss]);
         }
-        printf("%1cRow length: %d\n", ' ', hh);
+
+        timer_lap(&timers, PHASE_REDUCE);
+
+        tt += depth - 1;
+        continue;
       }
-      printf("Obstacle grid length: %d\n", count0);
-
-      count0 = 0;
-      printf("Printing local obstacles:\n");
-      for (ii = 0; ii < local_ny; ii++) {
-        printf("\nRow %d\n", ii+1);
-        for (jj = 0; jj < params.nx; jj++) {
-          printf("%d", obstacles[jj + ii]);
-          count0++;
+
+      if (tt == 0) {
+        #ifdef DEBUG_state_timestep
+        int aa, bb, cc, dd, ee, ff, gg, hh, ii, jj;
+        int local_ny = params.local_ny;
+        int count0 = 0;
+
+        printf("Params: %d %d %d %d %.4f %.4f %.4f\n", params.nx, params.ny, params.maxIters,
+        params.reynolds_dim, params.density, params.accel, params.omega);
+
+        printf("Printing main grid:\n");
+        for (aa = 0; aa < local_ny+2; aa++) {
+          printf("\nRow %d\n", aa+1);
+          for (bb = 0; bb < params.nx; bb++) {
+            for (int cc = 0; cc < 9; cc++) {
+              printf("%.2f ", SPEED(cells, bb + aa, cc));
+              count0++;
+            }
+          }
+          printf("%1cRow length: %d\n", ' ', bb);
+        }
+        printf("Main grid length: %d\n", count0);
+
+        count0 = 0;
+        printf("Printing helper grid:\n");
+        for (dd = 0; dd < local_ny+2; dd++) {
+          printf("\nRow %d\n", dd+1);
+          for (ee = 0; ee < params.nx; ee++) {
+            for (ff = 0; ff < 9; ff++) {
+              printf("%.2f", SPEED(tmp_cells, ee + dd, ff));
+              count0++;
+            }
+          }
+          printf("%1cRow length: %d\n", ' ', ee);
         }
-        printf("%1cRow length: %d\n", ' ', jj);
+        printf("Helper grid length: %d\n", count0);
+
+        count0 = 0;
+        printf("Printing local obstacles:\n");
+        for (ii = 0; ii < local_ny; ii++) {
+          printf("\nRow %d\n", ii+1);
+          for (jj = 0; jj < params.nx; jj++) {
+            printf("%d", obstacles[jj + ii]);
+            count0++;
+          }
+          printf("%1cRow length: %d\n", ' ', jj);
+        }
+        printf("Local obstacle grid length: %d\n", count0);
+        #endif
       }
-      printf("Local obstacle grid length: %d\n", count0);
+      #ifdef OFFLOAD
+      timestep_offload(params, cells, tmp_cells, obstacles, up, dn,
+                       send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn, row_u, &timers);
+      #else
+      #ifndef AA
+      /* the kernel can do the next timestep's forcing, unless the state in between
+      ** is looked at: written out at the end, checkpointed, or tested for a steady
+      ** state (which happens once av_vels has grown) */
+      params.accel_fold = tt + 1 < params.maxIters
+                          && !(checkpoint.path != NULL && tt + 1 >= checkpoint_next)
+                          && !(converge_tol > 0.f && (av_batch.done > converge_done || av_batch_completes(&av_batch)));
       #endif
+      float tot_u;
+      timestep(params, cells, tmp_cells, obstacles, &obstacle_list, up, dn,
+               send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn, collide, &tot_u, &timers);
+      params.accel_done = params.accel_fold;
+      #endif
+      #ifdef AA
+      /* updated in place, only the layout alternates */
+      params.aa_swapped = !params.aa_swapped;
+      #else
+      /* the new state is in tmp_cells, swap rather than copy it back */
+      t_speed* cells_swap = cells;
+      cells     = tmp_cells;
+      tmp_cells = cells_swap;
+      #endif
+      #ifdef OFFLOAD
+      /* copy the sums back a batch at a time */
+      av_velocity_offload(params, row_u, tot_u_dev, av_slot++);
+
+      if (av_slot == av_batch_size) av_batch_push_offload(&av_batch, av_vels, tot_u_dev, &av_slot);
+      #else
+      av_batch_push(&av_batch, av_vels, tot_u);
+      #endif
+      timer_lap(&timers, PHASE_REDUCE);
+      /* #ifdef DEBUG
+      ** printf("==timestep: %d==\n", tt);
+      ** printf("av velocity: %.12E\n", av_vels[tt]);
+      ** printf("tot density: %.12E\n", total_density(params, cells));
+      ** #endif */
     }
-    timestep(params, cells, tmp_cells, obstacles);
-    av_vels[tt] = av_velocity(params, cells, obstacles);
-    /* #ifdef DEBUG
-    ** printf("==timestep: %d==\n", tt);
-    ** printf("av velocity: %.12E\n", av_vels[tt]);
-    ** printf("tot density: %.12E\n", total_density(params, cells));
-    ** #endif */
-  }
-
-  /* MPI alterations
-  ** halo exchange for local grids
-  ** - send above, receive below
-  ** - send below, receive above
-  ** For each direction:
-  ** - pack send buffer using grid values
-  ** - exchange MPI_Sendrecv()
-  ** unpack receive buffer into grid
-  */
-  /* ------------------------------- END MAIN LOOP ------------------------------- */
+    /* ------------------------------- END MAIN LOOP ------------------------------- */
 
-  /* calculate timing post-execution */
-  gettimeofday(&timstr, NULL);
-  toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-  getrusage(RUSAGE_SELF, &ru);
-  timstr = ru.ru_utime;
-  usrtim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
-  timstr = ru.ru_stime;
-  systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+    #ifdef OFFLOAD
+    /* and the sums of the last, partial one */
+    av_batch_push_offload(&av_batch, av_vels, tot_u_dev, &av_slot);
+    #endif
 
-  /*
-  ** if (rank == MASTER) {
-  **   GATHER DATA
-  **   WRITE VALUES
-  ** }
-  */
-  /*  
-  ** Inverse MPI_Scatter
-  ** Only root process needs to have valid receive buffer
-  ** All other calling processes can pass NULL for recv_data
-  ** MPI_Gather (
-  ** void* send_data,
-  ** int send_count
-  ** MPI_Datatype send_datatype,
-  ** void* recv_data,
-  ** int recv_count,                // count of elements received per process, not total elements received
-  ** MPI_Datatype recv_datatype,
-  ** int root,
-  ** MPI_Comm communicator
-  ** )
-  */
+    /* reduce whatever is left of the last batch */
+    av_batch_flush(&av_batch, av_vels);
+    av_batch_free(&av_batch);
+    free(tb_tot_u);
+    timer_lap(&timers, PHASE_REDUCE);
+
+    /* the last checkpoint has to be complete before the run ends */
+    checkpoint_finish(&checkpoint, rank);
+    checkpoint_free(&checkpoint);
+    timer_lap(&timers, PHASE_CHECKPOINT);
+
+    /* the writer only has the last batch left */
+    if (stream != NULL) av_stream_close(stream);
+
+    #ifdef OFFLOAD
+    /* the final state comes back once */
+    offload_exit(params, cells, tmp_cells, obstacles, send_buff_up, send_buff_dn,
+                 recv_buff_up, recv_buff_dn, row_u, tot_u_dev, av_batch_size);
+    free(row_u);
+    free(tot_u_dev);
+    #endif
+
+    /* calculate timing post-execution */
+    gettimeofday(&timstr, NULL);
+    toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+    getrusage(RUSAGE_SELF, &ru);
+    timstr = ru.ru_utime;
+    usrtim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+    timstr = ru.ru_stime;
+    systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
+
+    /* Reynolds number needs every rank */
+    float reynolds = calc_reynolds(params, cells, obstacles);
+
+    /* write final values and free memory */
+    if (rank == MASTER)
+    {
+      printf("==done==\n");
+      if (members != NULL) printf("Ensemble member:\t\t%d (density %g, accel %g, omega %g)\n",
+                                  mm, params.density, params.accel, params.omega);
+      printf("Reynolds number:\t\t%.12E\n", reynolds);
+      printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
+      printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
+      printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+      printf("Collision kernel:\t\t%s\n", isa_name);
+      if (tb_depth > 1) printf("Temporal blocking depth:\t%d\n", tb_depth);
+      if (converged) printf("Converged after:\t\t%d iterations\n", params.maxIters);
+      if (size > 1) printf("Expected load imbalance:\t%.3f (max / mean slab cost)\n", params.imbalance);
+      if (params.proc_cols > 1) printf("Process grid:\t\t\t%d x %d (rows x columns)\n",
+                                       params.proc_rows, params.proc_cols);
+      if (params.solid_tiles > 0.f) printf("Solid tiles skipped:\t\t%.1f%%\n", 100.f * params.solid_tiles);
+      #ifdef _OPENMP
+      printf("Threads per rank:\t\t%d\n", omp_get_max_threads());
+      #endif
+    }
+    report_timings(params, &timers, params.maxIters - start, toc - tic, isa_name, timings_path, rank, size);
+    write_values(params, cells, obstacles, stream_av_vels ? NULL : av_vels, rank, binary_output);
+
+    if (check_av_vels != NULL || check_final_state != NULL)
+    {
+      /* a streamed series is only complete in the file */
+      series = av_vels;
+
+      if (stream != NULL && check_av_vels != NULL)
+      {
+        series = (float*)malloc(sizeof(float) * (params.maxIters > 0 ? params.maxIters : 1));
+
+        if (series == NULL) die("cannot allocate memory for av_vels", __LINE__, __FILE__);
+
+        av_vels_read(params.av_vels_file, params.maxIters, series);
+      }
+
+      check_failed = check_values(params, cells, obstacles, series, check_av_vels, check_final_state,
+                                  check_tolerance, rank);
+
+      if (series != av_vels) free(series);
+    }
+  }
+
+  free(members);
+
+  if (params.comm != MPI_COMM_WORLD) MPI_Comm_free(&params.comm);
 
-  /* write final values and free memory */
-  printf("==done==\n");
-  printf("Reynolds number:\t\t%.12E\n", calc_reynolds(params, cells, obstacles));
-  printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
-  printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
-  printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-  write_values(params, cells, obstacles, av_vels);
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+  finalise(&params, &cells, &tmp_cells, &obstacles, &obstacle_list, &av_vels, &arena);
 
   /* finalise the MPI environment */
   MPI_Finalize();
@@ -356,19 +1428,18 @@ int main(int argc, char* argv[])
   }
 
   /* exit the program */
-  return EXIT_SUCCESS;
+  return check_failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
 int initialise(const char* paramfile, const char* obstaclefile,
                t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr_total, int** obstacles_ptr,
-               float** av_vels_ptr, int size, float** send_buff_up,
-               float** send_buff_dn, float** recv_buff_up, float** recv_buff_dn)
+               uint8_t** obstacles_ptr, t_obstacle_list* obstacle_list,
+               float** av_vels_ptr, int rank, int size,
+               t_pop** send_buff_up, t_pop** send_buff_dn,
+               t_pop** recv_buff_up, t_pop** recv_buff_dn, t_arena* arena)
 {
   char   message[1024];  /* message buffer */
   FILE*  fp;             /* file pointer */
-  int    xx, yy;         /* generic array indices */
-  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
   int    retval;         /* to hold return value for checking */
 
   /* MPI_vars */
@@ -443,8 +1514,16 @@ int initialise(const char* paramfile, const char* obstaclefile,
   ** - buffers for message passing
   */
 
-  /* split rows by number of processors local_ny */
-  local_ny = params->ny / size;
+  /* the process grid decides each block's columns, and how many slabs the rows are split into */
+  setup_proc_grid(params, size);
+
+  /* split rows between processors by their cost, local_ny need not be the same on every rank */
+  partition_rows(obstaclefile, params, rank);
+
+  local_ny = params->local_ny;
+
+  /* room for both ghost columns (see the grid layout notes) */
+  params->pitch = GRIDPITCH(params->local_nx);
   #ifdef DEBUG_localNy
   printf("# of ranks in world: %d\n", size);
   printf("local_ny: no. of cells in y-direction in decomposed grid  %d\n", local_ny);
@@ -454,42 +1533,67 @@ int initialise(const char* paramfile, const char* obstaclefile,
   printf("Allocation beginning\n");
   #endif
 
+  /* the grids, mask and halo buffers below all come from one arena */
+  const size_t mask_bytes = sizeof(uint8_t) * (local_ny + 2*params->halo) * params->pitch;
+  /* halo rows, or the three densities of each ghost column column_exchange() sends */
+  const size_t row_buff  = (size_t)NSPEEDS * (params->local_nx + 2) * params->halo;
+  const size_t col_buff  = (params->proc_cols > 1) ? (size_t)3 * local_ny : 0;
+  const size_t buff_bytes = sizeof(t_pop) * ((row_buff > col_buff) ? row_buff : col_buff);
+  #ifdef AA
+  const int ngrids = 1;
+  #else
+  const int ngrids = 2;
+  #endif
+
+  /* each array may be moved up to a page along to reach its skew */
+  arena_init(arena, ngrids * grid_bytes(params) + mask_bytes + 4 * buff_bytes
+                    + (2 * ngrids + 5) * (size_t)(ALIASPAGE + ALIGNMENT), params->huge_pages);
+
   /* Main grid (w) */
   /* +2 to params->ny for halo rows... use local_ny */
-  /* Main grid size = size of (no. of cells in y-direction * no. of cells in x-direction) * size of t_speed struct */
-  *cells_ptr = (t_speed*)malloc(sizeof(t_speed) * ((local_ny + 2) * params->nx));
+  /* Main grid size = size of (no. of cells in y-direction * row pitch) * size of t_speed struct */
+  *cells_ptr = alloc_grid(params, arena);
 
   if (*cells_ptr == NULL) die("cannot allocate memory for cells", __LINE__, __FILE__);
 
   /* Helper grid, used as scratch space (u) */
   /* +2 to params->ny for halo rows... use local_ny */
-  /* Helper grid size = size of (no. of cells in y-direction * no. of cells in x-direction) * size of t_speed struct */
-  *tmp_cells_ptr = (t_speed*)malloc(sizeof(t_speed) * ((local_ny + 2) * params->nx));
+  /* Helper grid size = size of (no. of cells in y-direction * row pitch) * size of t_speed struct */
+  #ifdef AA
+  /* not needed, the AA pattern streams in place */
+  *tmp_cells_ptr = NULL;
+  params->aa_swapped = 0;
+  #else
+  *tmp_cells_ptr = alloc_grid(params, arena);
 
   if (*tmp_cells_ptr == NULL) die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
+  #endif
 
-  /* the map of obstacles */
-  /* Obstacle map size = size of (no. of cells in y-direction * no. of cells in x-direction) * size of int */
-  *obstacles_ptr_total = malloc(sizeof(int) * (params->ny * params->nx));
+  /* use local_ny, + 2*halo so it shares the indexing of the main grid */
+  /* Local obstacle map size = size of (no. of cells in y-direction * row pitch) bytes */
+  *obstacles_ptr = (uint8_t*)arena_alloc(arena, mask_bytes, 1);
 
-  if (*obstacles_ptr_total == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
 
-  /* use local_ny, but doesn't require +2 for halos */
-  /* Local obstacle map size = size of (no. of cells in y-direction * no. of cells in x-direction) * size of int */
-  *obstacles_ptr = malloc(sizeof(int) * (local_ny * params->nx));
+  *obstacles_ptr += (params->halo - 1) * params->pitch;
 
-  if (*obstacles_ptr == NULL) die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+  /* allocate space to hold a record of the avarage velocities computed at each
+  ** timestep, or with --av-vels=stream the last av_ring of them */
+  if (params->av_ring < 1 || params->av_ring > params->maxIters) params->av_ring = params->maxIters;
+  if (params->av_ring < 1) params->av_ring = 1;
 
-  /* allocate space to hold a record of the avarage velocities computed at each timestep */
-  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
+  *av_vels_ptr = (float*)malloc(sizeof(float) * params->av_ring);
 
   if (*av_vels_ptr == NULL) die("Cannot allocate memory for av_vels", __LINE__, __FILE__);
 
-  /* allocate send & recv buffers */
-  *send_buff_up = (float*)malloc(sizeof(float) * params->nx);
-  *send_buff_dn = (float*)malloc(sizeof(float) * params->nx);
-  *recv_buff_up = (float*)malloc(sizeof(float) * params->nx);
-  *recv_buff_dn = (float*)malloc(sizeof(float) * params->nx);
+  /* allocate send & recv buffers, halo full rows of speeds each */
+  *send_buff_up = (t_pop*)arena_alloc(arena, buff_bytes, 1);
+  *send_buff_dn = (t_pop*)arena_alloc(arena, buff_bytes, 1);
+  *recv_buff_up = (t_pop*)arena_alloc(arena, buff_bytes, 1);
+  *recv_buff_dn = (t_pop*)arena_alloc(arena, buff_bytes, 1);
+
+  if (*send_buff_up == NULL || *send_buff_dn == NULL
+      || *recv_buff_up == NULL || *recv_buff_dn == NULL) die("cannot allocate memory for halo buffers", __LINE__, __FILE__);
 
   #ifdef DEBUG_init_checkpoints
   printf("Allocation complete\n");
@@ -502,38 +1606,7 @@ int initialise(const char* paramfile, const char* obstaclefile,
   */
 
   /* initialise densities for present time (w) */
-  float w0 = params->density * 4.f / 9.f;
-  float w1 = params->density       / 9.f;
-  float w2 = params->density       / 36.f;
-
-  /* change loop boundaries ny -> local_ny */
-  /* +1 to jj before adding with ii and multiplying, to account for top halo */
-  /* change < to <=, to account for bottom halo */
-  for (int jj = 1; jj <= local_ny; jj++)   /* row */
-  {
-    for (int ii = 0; ii < params->nx; ii++) /* cols */
-    {
-      /*
-      ** 6 2 5
-      **  \|/
-      ** 3-0-1
-      **  /|\
-      ** 7 4 8
-      */
-      /* centre */
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[0] = w0;
-      /* axis directions */
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[1] = w1;
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[2] = w1;
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[3] = w1;
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[4] = w1;
-      /* diagonals */
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[5] = w2;
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[6] = w2;
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[7] = w2;
-      (*cells_ptr)[ii + (jj)*params->nx].speeds[8] = w2;
-    }
-  }
+  init_cells(params, *cells_ptr, *tmp_cells_ptr);
 
   #ifdef DEBUG_mainGrid
   int count = 0;
@@ -542,7 +1615,7 @@ int initialise(const char* paramfile, const char* obstaclefile,
     for (int ii = 0; ii < params->nx; ii++) {
       for (int ss = 0; ss < 9; ss++) {
         #ifdef DEBUG_mainGridV
-        printf("%.2f", (*cells_ptr)[ii + jj].speeds[ss]);
+        printf("%.2f", SPEED((*cells_ptr), ii + jj, ss));
         #endif
         count++;
       }
@@ -557,18 +1630,21 @@ int initialise(const char* paramfile, const char* obstaclefile,
   printf("Setting total to 0 beginning\n");
   #endif
 
-  /* first set all cells in total obstacle array to zero */
-  for (int jj = 0; jj < params->ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
-    {
-      (*obstacles_ptr_total)[ii + jj*params->nx] = 0;
-    }
-  }
+  /* the local obstacle map: only this rank's rows and its halo rows are read, the full map is never built */
+  load_obstacles(obstaclefile, params, *obstacles_ptr);
 
-  #ifdef DEBUG_init_checkpoints
-  printf("Setting total to 0 complete\n\n");
-  #endif
+  /* the blocked cells as a list for rebound, and the fluid cell count for the
+  ** av. velocity, which never change */
+  const int blocked_cells = build_obstacle_list(params, *obstacles_ptr, obstacle_list);
+  const int local_fluid_cells = local_ny * params->local_nx - blocked_cells;
+  MPI_Allreduce(&local_fluid_cells, &params->fluid_cells, 1, MPI_INT, MPI_SUM, params->comm);
+
+  /* the forced rows, only their owners (and, with --tb-depth, the ranks that have copies) do any forcing */
+  set_accel_rows(params);
+
+  int tiles[2] = { obstacle_list->solid, obstacle_list->tiles }; /* solid and all, summed over ranks */
+  MPI_Allreduce(MPI_IN_PLACE, tiles, 2, MPI_INT, MPI_SUM, params->comm);
+  params->solid_tiles = (tiles[1] > 0) ? (float)tiles[0] / tiles[1] : 0.f;
 
   #ifdef DEBUG_obstacleGrid
   int count2 = 0;
@@ -582,71 +1658,6 @@ int initialise(const char* paramfile, const char* obstaclefile,
   printf("Obstacle grid length: %d\n", count2);
   #endif
 
-  #ifdef DEBUG_init_checkpoints
-  int rank;
-  MPI_Comm_rank( MPI_COMM_WORLD, &rank );
-  printf("Rank %d Checkpoint0\n", rank);
-  #endif
-
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile, "r");
-
-  if (fp == NULL)
-  {
-    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
-    die(message, __LINE__, __FILE__);
-  }
-
-  #ifdef DEBUG_init_checkpoints
-  printf("Rank %d Checkpoint01\n", rank);
-  #endif
-
-  /* read-in the blocked cells list */
-  int count = 0;
-  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
-  {
-    /* some checks */
-    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
-
-    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
-
-    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
-
-    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
-
-    #ifdef DEBUG_init_checkpoints
-    printf("Rank %d Checkpoint02. Count %d\n", rank, count);
-    count++;
-    #endif
-
-    /* assign obstacle to the total obstacles array */
-    (*obstacles_ptr_total)[xx + yy*params->nx] = blocked;
-  }
-
-  #ifdef DEBUG_init_checkpoints
-  printf("Rank %d Checkpoint10\n", rank);
-  #endif
-
-  #ifdef DEBUG_init_checkpoints
-  printf("Setting local to 0 beginning\n");
-  #endif
-
-  /* first set all cells in local obstacle array to appropriate region of total obstacle array */
-  for (int jj = 0; jj < local_ny; jj++)
-  {
-    for (int ii = 0; ii < params->nx; ii++)
-    {
-      (*obstacles_ptr)[ii + jj*params->nx] = (*obstacles_ptr_total)[ii + jj*params->nx];
-    }
-  }
-
-  #ifdef DEBUG_init_checkpoints
-  printf("Setting local to 0 complete\n\n");
-  #endif
-
-  /* and close the file */
-  fclose(fp);
-
   /* scatter arrays to other processes */
   /*  
   ** MPI_Scatter (
@@ -674,381 +1685,3062 @@ int initialise(const char* paramfile, const char* obstaclefile,
   return EXIT_SUCCESS;
 }
 
-int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+int set_accel_rows(t_param* params)
 {
-  accelerate_flow(params, cells, obstacles);
-  propagate(params, cells, tmp_cells);
-  rebound(params, cells, tmp_cells, obstacles);
-  collision(params, cells, tmp_cells, obstacles);
-  return EXIT_SUCCESS;
-}
+  const char* item = params->accel_spec; /* the next item of the list */
+  const int first = 1 - params->halo;                /* first halo row */
+  const int last  = params->local_ny + params->halo; /* last halo row */
+  uint8_t*  forced;                                  /* forced[yy] for global row yy */
 
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles)
-{
-  /* compute weighting factors */
-  float w1 = params.density * params.accel / 9.f;
-  float w2 = params.density * params.accel / 36.f;
+  forced = (uint8_t*)calloc((size_t)params->ny, 1);
+  params->accel_rows = (uint8_t*)malloc((size_t)(last - first + 1));
 
-  /* modify the 2nd row of the grid */
-  int jj = params.ny - 2;
+  if (forced == NULL || params->accel_rows == NULL) die("cannot allocate memory for forced rows", __LINE__, __FILE__);
 
-  for (int ii = 0; ii < params.nx; ii++)
+  params->accel_rows -= first;
+
+  if (item == NULL)
   {
-    /* if the cell is not occupied and
-    ** we don't send a negative density */
-    if (!obstacles[ii + jj*params.nx]
-        && (cells[ii + jj*params.nx].speeds[3] - w1) > 0.f
-        && (cells[ii + jj*params.nx].speeds[6] - w2) > 0.f
-        && (cells[ii + jj*params.nx].speeds[7] - w2) > 0.f)
+    /* the 2nd row from the top, as ever */
+    if (params->ny >= 2) forced[params->ny - 2] = 1;
+  }
+  else if (strcmp(item, "all") == 0)
+  {
+    memset(forced, 1, (size_t)params->ny);
+  }
+  else
+  {
+    for (;;)
     {
-      /* increase 'east-side' densities */
-      cells[ii + jj*params.nx].speeds[1] += w1;
-      cells[ii + jj*params.nx].speeds[5] += w2;
-      cells[ii + jj*params.nx].speeds[8] += w2;
-      /* decrease 'west-side' densities */
-      cells[ii + jj*params.nx].speeds[3] -= w1;
-      cells[ii + jj*params.nx].speeds[6] -= w2;
-      cells[ii + jj*params.nx].speeds[7] -= w2;
+      int y0, y1; /* the rows of this item */
+      int len;    /* no. of characters it takes */
+
+      if (sscanf(item, "%d:%d%n", &y0, &y1, &len) != 2)
+      {
+        if (sscanf(item, "%d%n", &y0, &len) != 1) die("--accel-rows must be all or a list of Y or Y0:Y1", __LINE__, __FILE__);
+
+        y1 = y0;
+      }
+
+      if (y0 < 0) y0 += params->ny;
+      if (y1 < 0) y1 += params->ny;
+
+      if (y0 < 0 || y1 > params->ny - 1 || y0 > y1) die("--accel-rows row out of range", __LINE__, __FILE__);
+
+      memset(forced + y0, 1, (size_t)(y1 - y0 + 1));
+
+      item += len;
+
+      if (*item == '\0') break;
+
+      if (*item != ',') die("--accel-rows must be all or a list of Y or Y0:Y1", __LINE__, __FILE__);
+
+      item++;
     }
   }
 
-  return EXIT_SUCCESS;
-}
+  /* local row jj is global row row_offset + jj - 1, wrapping around in the halo rows */
+  params->accel_local = 0;
 
-int propagate(const t_param params, t_speed* cells, t_speed* tmp_cells)
-{
-  /* loop over _all_ cells */
-  for (int jj = 0; jj < params.ny; jj++)
+  for (int jj = first; jj <= last; jj++)
   {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* determine indices of axis-direction neighbours
-      ** respecting periodic boundary conditions (wrap around) */
-      int y_n = (jj + 1) % params.ny;
-      int x_e = (ii + 1) % params.nx;
-      int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
-      int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
-      /* propagate densities from neighbouring cells, following
-      ** appropriate directions of travel and writing into
-      ** scratch space grid */
-      tmp_cells[ii + jj*params.nx].speeds[0] = cells[ii + jj*params.nx].speeds[0]; /* central cell, no movement */
-      tmp_cells[ii + jj*params.nx].speeds[1] = cells[x_w + jj*params.nx].speeds[1]; /* east */
-      tmp_cells[ii + jj*params.nx].speeds[2] = cells[ii + y_s*params.nx].speeds[2]; /* north */
-      tmp_cells[ii + jj*params.nx].speeds[3] = cells[x_e + jj*params.nx].speeds[3]; /* west */
-      tmp_cells[ii + jj*params.nx].speeds[4] = cells[ii + y_n*params.nx].speeds[4]; /* south */
-      tmp_cells[ii + jj*params.nx].speeds[5] = cells[x_w + y_s*params.nx].speeds[5]; /* north-east */
-      tmp_cells[ii + jj*params.nx].speeds[6] = cells[x_e + y_s*params.nx].speeds[6]; /* north-west */
-      tmp_cells[ii + jj*params.nx].speeds[7] = cells[x_e + y_n*params.nx].speeds[7]; /* south-west */
-      tmp_cells[ii + jj*params.nx].speeds[8] = cells[x_w + y_n*params.nx].speeds[8]; /* south-east */
-    }
+    params->accel_rows[jj] = forced[((params->row_offset + jj - 1) % params->ny + params->ny) % params->ny];
+
+    if (jj >= 1 && jj <= params->local_ny) params->accel_local += params->accel_rows[jj];
   }
 
+  free(forced);
+
   return EXIT_SUCCESS;
 }
 
-int rebound(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+int setup_proc_grid(t_param* params, int size)
 {
-  /* loop over the cells in the grid */
-  for (int jj = 0; jj < params.ny; jj++)
+  int dims[2];                 /* proc_rows, proc_cols */
+  int periods[2] = { 1, 1 };   /* periodic in both directions */
+  int coords[2];               /* this rank's proc_row, proc_col */
+  int rank;                    /* in the new communicator */
+  int can_split = (params->halo == 1); /* column_exchange() only fills one-row halos */
+  MPI_Comm grid_comm;
+
+  /* the AA fold and the device path only know the local wrap around in x */
+  #if defined(AA) || defined(OFFLOAD)
+  can_split = 0;
+  #endif
+
+  /*
+  ** auto: per rank about 3 * nx / proc_cols densities cross each halo row,
+  ** and once the columns are split 3 * ny / proc_rows each ghost column;
+  ** a single column wins ties, it keeps the local wrap around in x
+  */
+  if (params->proc_rows == 0)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    double best = params->nx;  /* traffic of one row per rank */
+
+    params->proc_rows = size;
+    params->proc_cols = 1;
+
+    for (int cols = 2; can_split && cols <= size && cols <= params->nx; cols++)
     {
-      /* if the cell contains an obstacle */
-      if (obstacles[jj*params.nx + ii])
+      const int    rows    = size / cols;
+      const double traffic = (double)params->nx / cols + (double)params->ny / rows;
+
+      if (rows * cols != size || rows * params->halo > params->ny) continue;
+
+      if (traffic < best)
       {
-        /* called after propagate, so taking values from scratch space
-        ** mirroring, and writing into main grid */
-        cells[ii + jj*params.nx].speeds[1] = tmp_cells[ii + jj*params.nx].speeds[3];
-        cells[ii + jj*params.nx].speeds[2] = tmp_cells[ii + jj*params.nx].speeds[4];
-        cells[ii + jj*params.nx].speeds[3] = tmp_cells[ii + jj*params.nx].speeds[1];
-        cells[ii + jj*params.nx].speeds[4] = tmp_cells[ii + jj*params.nx].speeds[2];
-        cells[ii + jj*params.nx].speeds[5] = tmp_cells[ii + jj*params.nx].speeds[7];
-        cells[ii + jj*params.nx].speeds[6] = tmp_cells[ii + jj*params.nx].speeds[8];
-        cells[ii + jj*params.nx].speeds[7] = tmp_cells[ii + jj*params.nx].speeds[5];
-        cells[ii + jj*params.nx].speeds[8] = tmp_cells[ii + jj*params.nx].speeds[6];
+        best = traffic;
+        params->proc_rows = rows;
+        params->proc_cols = cols;
       }
     }
   }
 
+  if (params->proc_rows * params->proc_cols != size)
+  {
+    die("--proc-grid must have one block per rank: rows * columns == no. of ranks", __LINE__, __FILE__);
+  }
+
+  if (params->proc_cols > 1 && !can_split)
+  {
+    die("a --proc-grid with more than one column needs the two-grid, non-offload build and --tb-depth=1", __LINE__, __FILE__);
+  }
+
+  if (params->proc_cols > params->nx) die("--proc-grid has more columns than nx", __LINE__, __FILE__);
+
+  /* no reordering: MASTER stays rank 0, and with one column the slabs stay in rank order */
+  dims[0] = params->proc_rows;
+  dims[1] = params->proc_cols;
+  MPI_Cart_create(params->comm, 2, dims, periods, 0, &grid_comm);
+
+  if (params->comm != MPI_COMM_WORLD) MPI_Comm_free(&params->comm);
+
+  params->comm = grid_comm;
+
+  MPI_Comm_rank(params->comm, &rank);
+  MPI_Cart_coords(params->comm, rank, 2, coords);
+  params->proc_row = coords[0];
+  params->proc_col = coords[1];
+  MPI_Cart_shift(params->comm, 1, 1, &params->left, &params->right);
+
+  /* columns are split evenly, remainder spread out; the rows by cost in partition_rows() */
+  params->col_offset = (int)((long)params->proc_col * params->nx / params->proc_cols);
+  params->local_nx   = (int)((long)(params->proc_col + 1) * params->nx / params->proc_cols) - params->col_offset;
+
   return EXIT_SUCCESS;
 }
 
-int collision(const t_param params, t_speed* cells, t_speed* tmp_cells, int* obstacles)
+int partition_rows(const char* obstaclefile, t_param* params, int rank)
 {
-  const float c_sq = 1.f / 3.f; /* square of speed of sound */
-  const float w0 = 4.f / 9.f;  /* weighting factor */
-  const float w1 = 1.f / 9.f;  /* weighting factor */
-  const float w2 = 1.f / 36.f; /* weighting factor */
+  const int size = params->proc_rows; /* no. of slabs, each shared by a row of the process grid */
+  const int min_rows = params->halo; /* the deep halos come from the neighbouring slabs only */
+  int*    blocked;                   /* blocked cells per global row */
+  double* cost;                      /* cost[yy] = cost of global rows 0..yy-1 */
+  int     yy = 0;                    /* candidate first row of the next slab */
+  int     first = 0;                 /* first row of the current slab */
+  double  max_cost = 0.0;            /* of the costliest slab */
+
+  if (params->ny < size * min_rows)
+  {
+    die("each slab needs at least --tb-depth rows: ny must be >= process rows * tb-depth", __LINE__, __FILE__);
+  }
+
+  if (params->blocked_cost < 0.f) die("--blocked-cost must not be negative", __LINE__, __FILE__);
+
+  blocked = (int*)calloc(params->ny, sizeof(int));
+  cost    = (double*)malloc(sizeof(double) * (params->ny + 1));
+
+  if (blocked == NULL || cost == NULL) die("cannot allocate memory for partition", __LINE__, __FILE__);
+
+  /* one rank reads the whole file, the row counts are small */
+  if (rank == MASTER) count_blocked_rows(obstaclefile, params, blocked);
+
+  MPI_Bcast(blocked, params->ny, MPI_INT, MASTER, params->comm);
+
+  cost[0] = 0.0;
+
+  for (int jj = 0; jj < params->ny; jj++)
+  {
+    cost[jj + 1] = cost[jj] + (params->nx - blocked[jj]) + params->blocked_cost * blocked[jj];
+  }
 
-  /* loop over the cells in the grid
-  ** NB the collision step is called after
-  ** the propagate step and so values of interest
-  ** are in the scratch-space grid */
-  for (int jj = 0; jj < params.ny; jj++)
+  /* every rank walks the same boundaries: slab rr ends at the row boundary
+  ** closest to rr + 1 shares of the total cost, but leaves each slab at least
+  ** min_rows rows; with equal row costs the remainder rows are spread out */
+  for (int rr = 0; rr < size; rr++)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    int last;  /* one past the last row of slab rr */
+
+    if (rr == size - 1)
     {
-      /* don't consider occupied cells */
-      if (!obstacles[ii + jj*params.nx])
-      {
-        /* compute local density total */
-        float local_density = 0.f;
+      last = params->ny;
+    }
+    else
+    {
+      const double target = cost[params->ny] * (rr + 1) / size;
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += tmp_cells[ii + jj*params.nx].speeds[kk];
-        }
+      while (yy < params->ny && cost[yy] < target) yy++;
 
-        /* compute x velocity component */
-        float u_x = (tmp_cells[ii + jj*params.nx].speeds[1]
-                      + tmp_cells[ii + jj*params.nx].speeds[5]
-                      + tmp_cells[ii + jj*params.nx].speeds[8]
-                      - (tmp_cells[ii + jj*params.nx].speeds[3]
-                         + tmp_cells[ii + jj*params.nx].speeds[6]
-                         + tmp_cells[ii + jj*params.nx].speeds[7]))
-                     / local_density;
-        /* compute y velocity component */
-        float u_y = (tmp_cells[ii + jj*params.nx].speeds[2]
-                      + tmp_cells[ii + jj*params.nx].speeds[5]
-                      + tmp_cells[ii + jj*params.nx].speeds[6]
-                      - (tmp_cells[ii + jj*params.nx].speeds[4]
-                         + tmp_cells[ii + jj*params.nx].speeds[7]
-                         + tmp_cells[ii + jj*params.nx].speeds[8]))
-                     / local_density;
-
-        /* velocity squared */
-        float u_sq = u_x * u_x + u_y * u_y;
-
-        /* directional velocity components */
-        float u[NSPEEDS];
-        u[1] =   u_x;        /* east */
-        u[2] =         u_y;  /* north */
-        u[3] = - u_x;        /* west */
-        u[4] =       - u_y;  /* south */
-        u[5] =   u_x + u_y;  /* north-east */
-        u[6] = - u_x + u_y;  /* north-west */
-        u[7] = - u_x - u_y;  /* south-west */
-        u[8] =   u_x - u_y;  /* south-east */
-
-        /* equilibrium densities */
-        float d_equ[NSPEEDS];
-        /* zero velocity density: weight w0 */
-        d_equ[0] = w0 * local_density
-                   * (1.f - u_sq / (2.f * c_sq));
-        /* axis speeds: weight w1 */
-        d_equ[1] = w1 * local_density * (1.f + u[1] / c_sq
-                                         + (u[1] * u[1]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[2] = w1 * local_density * (1.f + u[2] / c_sq
-                                         + (u[2] * u[2]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[3] = w1 * local_density * (1.f + u[3] / c_sq
-                                         + (u[3] * u[3]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[4] = w1 * local_density * (1.f + u[4] / c_sq
-                                         + (u[4] * u[4]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        /* diagonal speeds: weight w2 */
-        d_equ[5] = w2 * local_density * (1.f + u[5] / c_sq
-                                         + (u[5] * u[5]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[6] = w2 * local_density * (1.f + u[6] / c_sq
-                                         + (u[6] * u[6]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[7] = w2 * local_density * (1.f + u[7] / c_sq
-                                         + (u[7] * u[7]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-        d_equ[8] = w2 * local_density * (1.f + u[8] / c_sq
-                                         + (u[8] * u[8]) / (2.f * c_sq * c_sq)
-                                         - u_sq / (2.f * c_sq));
-
-        /* relaxation step */
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          cells[ii + jj*params.nx].speeds[kk] = tmp_cells[ii + jj*params.nx].speeds[kk]
-                                                  + params.omega
-                                                  * (d_equ[kk] - tmp_cells[ii + jj*params.nx].speeds[kk]);
-        }
-      }
+      last = (yy > 0 && target - cost[yy - 1] < cost[yy] - target) ? yy - 1 : yy;
+
+      if (last < first + min_rows) last = first + min_rows;
+
+      if (last > params->ny - (size - 1 - rr) * min_rows) last = params->ny - (size - 1 - rr) * min_rows;
+    }
+
+    if (cost[last] - cost[first] > max_cost) max_cost = cost[last] - cost[first];
+
+    if (rr == params->proc_row)
+    {
+      params->row_offset = first;
+      params->local_ny   = last - first;
     }
+
+    first = last;
   }
 
+  params->imbalance = (cost[params->ny] > 0.0) ? (float)(max_cost * size / cost[params->ny]) : 1.f;
+
+  free(blocked);
+  free(cost);
+
   return EXIT_SUCCESS;
 }
 
-float av_velocity(const t_param params, t_speed* cells, int* obstacles)
+int count_blocked_rows(const char* obstaclefile, const t_param* params, int* blocked)
 {
-  int    tot_cells = 0;  /* no. of cells used in calculation */
-  float tot_u;          /* accumulated magnitudes of velocity for each cell */
+  char  message[1024];                 /* message buffer */
+  char  magic[OBSTACLESMAGICLEN] = {0}; /* first bytes of the file */
+  FILE* fp;                            /* file pointer */
+  int   xx, yy;                        /* generic array indices */
+  int   value;                         /* blocked value of a text line */
 
-  /* initialise */
-  tot_u = 0.f;
+  fp = fopen(obstaclefile, "rb");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
 
-  /* loop over all non-blocked cells */
-  for (int jj = 0; jj < params.ny; jj++)
+  /* same two formats as load_obstacles(), which checks them in full */
+  if (fread(magic, 1, OBSTACLESMAGICLEN, fp) == OBSTACLESMAGICLEN
+      && memcmp(magic, OBSTACLESMAGIC, OBSTACLESMAGICLEN) == 0)
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    const long     row_bytes = OBSTACLESROWBYTES(params->nx);
+    int            dims[2];  /* nx, ny from the header */
+    unsigned char* row = (unsigned char*)malloc((size_t)row_bytes);
+
+    if (row == NULL) die("cannot allocate memory for obstacle row", __LINE__, __FILE__);
+
+    if (fread(dims, sizeof(int), 2, fp) != 2 || dims[0] != params->nx || dims[1] != params->ny)
     {
-      /* ignore occupied cells */
-      if (!obstacles[ii + jj*params.nx])
-      {
-        /* local density total */
-        float local_density = 0.f;
+      die("binary obstacle file header does not match the parameter file", __LINE__, __FILE__);
+    }
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii + jj*params.nx].speeds[kk];
-        }
+    for (int jj = 0; jj < params->ny; jj++)
+    {
+      if (fread(row, 1, (size_t)row_bytes, fp) != (size_t)row_bytes)
+      {
+        die("binary obstacle file is truncated", __LINE__, __FILE__);
+      }
 
-        /* x-component of velocity */
-        float u_x = (cells[ii + jj*params.nx].speeds[1]
-                      + cells[ii + jj*params.nx].speeds[5]
-                      + cells[ii + jj*params.nx].speeds[8]
-                      - (cells[ii + jj*params.nx].speeds[3]
-                         + cells[ii + jj*params.nx].speeds[6]
-                         + cells[ii + jj*params.nx].speeds[7]))
-                     / local_density;
-        /* compute y velocity component */
-        float u_y = (cells[ii + jj*params.nx].speeds[2]
-                      + cells[ii + jj*params.nx].speeds[5]
-                      + cells[ii + jj*params.nx].speeds[6]
-                      - (cells[ii + jj*params.nx].speeds[4]
-                         + cells[ii + jj*params.nx].speeds[7]
-                         + cells[ii + jj*params.nx].speeds[8]))
-                     / local_density;
-        /* accumulate the norm of x- and y- velocity components */
-        tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
-        /* increase counter of inspected cells */
-        ++tot_cells;
+      for (int ii = 0; ii < params->nx; ii++)
+      {
+        blocked[jj] += (row[ii / 8] >> (ii % 8)) & 1;
       }
     }
+
+    free(row);
+  }
+  else
+  {
+    rewind(fp);
+
+    while (fscanf(fp, "%d %d %d\n", &xx, &yy, &value) == 3)
+    {
+      if (yy >= 0 && yy < params->ny && xx >= 0 && xx < params->nx) blocked[yy]++;
+    }
   }
 
-  return tot_u / (float)tot_cells;
+  fclose(fp);
+
+  return EXIT_SUCCESS;
 }
 
-float total_density(const t_param params, t_speed* cells)
+int init_cells(t_param* params, t_speed* cells, t_speed* tmp_cells)
 {
-  float total = 0.f;  /* accumulator */
+  float w0 = params->density * 4.f / 9.f;
+  float w1 = params->density       / 9.f;
+  float w2 = params->density       / 36.f;
+
+  #ifdef POP_REDUCED
+  /* the grids store deviations from these, so the initial state is all zeros */
+  params->pop_ref[0] = w0;
+  for (int kk = 1; kk < 5; kk++) params->pop_ref[kk] = w1;
+  for (int kk = 5; kk < NSPEEDS; kk++) params->pop_ref[kk] = w2;
+  #endif
 
-  for (int jj = 0; jj < params.ny; jj++)
+  /* +1 to jj to account for the top halo, <= for the bottom one */
+  /* same static row schedule as the kernels: each thread first-touches
+  ** (and so places on its own NUMA node) the rows it will update */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 1; jj <= params->local_ny; jj++)   /* row */
   {
-    for (int ii = 0; ii < params.nx; ii++)
+    for (int ii = 0; ii < params->local_nx; ii++) /* cols */
     {
+      /*
+      ** 6 2 5
+      **  \|/
+      ** 3-0-1
+      **  /|\
+      ** 7 4 8
+      */
+      /* centre */
+      SPEED(cells, ii + (jj)*params->pitch, 0) = POP_PUT(*params, w0, 0);
+      /* axis directions */
+      SPEED(cells, ii + (jj)*params->pitch, 1) = POP_PUT(*params, w1, 1);
+      SPEED(cells, ii + (jj)*params->pitch, 2) = POP_PUT(*params, w1, 2);
+      SPEED(cells, ii + (jj)*params->pitch, 3) = POP_PUT(*params, w1, 3);
+      SPEED(cells, ii + (jj)*params->pitch, 4) = POP_PUT(*params, w1, 4);
+      /* diagonals */
+      SPEED(cells, ii + (jj)*params->pitch, 5) = POP_PUT(*params, w2, 5);
+      SPEED(cells, ii + (jj)*params->pitch, 6) = POP_PUT(*params, w2, 6);
+      SPEED(cells, ii + (jj)*params->pitch, 7) = POP_PUT(*params, w2, 7);
+      SPEED(cells, ii + (jj)*params->pitch, 8) = POP_PUT(*params, w2, 8);
+      /* scratch space is overwritten before it is read, touch it for placement only */
+      #ifndef AA
       for (int kk = 0; kk < NSPEEDS; kk++)
       {
-        total += cells[ii + jj*params.nx].speeds[kk];
+        SPEED(tmp_cells, ii + (jj)*params->pitch, kk) = 0.f;
       }
+      #endif
     }
   }
 
-  return total;
-}
+  #ifdef AA
+  (void)tmp_cells;
+  params->aa_swapped = 0;
+  #endif
 
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles)
-{
-  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  /* nothing has been forced yet */
+  params->accel_done = 0;
 
-  return av_velocity(params, cells, obstacles) * params.reynolds_dim / viscosity;
+  return EXIT_SUCCESS;
 }
 
-int write_values(const t_param params, t_speed* cells, int* obstacles, float* av_vels)
+int read_ensemble(const char* path, t_member** members_ptr)
 {
-  FILE* fp;                     /* file pointer */
-  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
-  float local_density;         /* per grid cell sum of densities */
-  float pressure;              /* fluid pressure in grid cell */
-  float u_x;                   /* x-component of velocity in grid cell */
-  float u_y;                   /* y-component of velocity in grid cell */
-  float u;                     /* norm--root of summed squares--of u_x and u_y */
+  char      message[1024];  /* message buffer */
+  FILE*     fp;             /* file pointer */
+  t_member  member;         /* the one being read */
+  int       count = 0;      /* no. of members read */
+  int       capacity = 16;  /* no. allocated */
+  int       retval;         /* to hold return value for checking */
 
-  fp = fopen(FINALSTATEFILE, "w");
+  fp = fopen(path, "r");
 
   if (fp == NULL)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    sprintf(message, "could not open ensemble file: %s", path);
+    die(message, __LINE__, __FILE__);
   }
 
-  for (int jj = 0; jj < params.ny; jj++)
-  {
-    for (int ii = 0; ii < params.nx; ii++)
-    {
-      /* an occupied cell */
-      if (obstacles[ii + jj*params.nx])
-      {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
-      }
-      /* no obstacle */
-      else
-      {
-        local_density = 0.f;
+  *members_ptr = (t_member*)malloc(sizeof(t_member) * capacity);
 
-        for (int kk = 0; kk < NSPEEDS; kk++)
-        {
-          local_density += cells[ii + jj*params.nx].speeds[kk];
-        }
+  if (*members_ptr == NULL) die("cannot allocate memory for ensemble", __LINE__, __FILE__);
 
-        /* compute x velocity component */
-        u_x = (cells[ii + jj*params.nx].speeds[1]
-               + cells[ii + jj*params.nx].speeds[5]
-               + cells[ii + jj*params.nx].speeds[8]
-               - (cells[ii + jj*params.nx].speeds[3]
-                  + cells[ii + jj*params.nx].speeds[6]
-                  + cells[ii + jj*params.nx].speeds[7]))
-              / local_density;
-        /* compute y velocity component */
-        u_y = (cells[ii + jj*params.nx].speeds[2]
-               + cells[ii + jj*params.nx].speeds[5]
-               + cells[ii + jj*params.nx].speeds[6]
-               - (cells[ii + jj*params.nx].speeds[4]
-                  + cells[ii + jj*params.nx].speeds[7]
-                  + cells[ii + jj*params.nx].speeds[8]))
-              / local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
-      }
+  while ((retval = fscanf(fp, "%f %f %f\n", &member.density, &member.accel, &member.omega)) != EOF)
+  {
+    if (retval != 3) die("expected 3 values (density accel omega) per line in ensemble file", __LINE__, __FILE__);
+
+    if (count == capacity)
+    {
+      capacity *= 2;
+      *members_ptr = (t_member*)realloc(*members_ptr, sizeof(t_member) * capacity);
 
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u, pressure, obstacles[ii * params.nx + jj]);
+      if (*members_ptr == NULL) die("cannot allocate memory for ensemble", __LINE__, __FILE__);
     }
+
+    (*members_ptr)[count++] = member;
   }
 
   fclose(fp);
 
-  fp = fopen(AVVELSFILE, "w");
+  if (count == 0) die("ensemble file has no members", __LINE__, __FILE__);
+
+  return count;
+}
+
+int load_obstacles(const char* obstaclefile, const t_param* params, uint8_t* obstacles)
+{
+  char  message[1024];                 /* message buffer */
+  char  magic[OBSTACLESMAGICLEN] = {0}; /* first bytes of the file */
+  FILE* fp;                            /* file pointer */
+
+  /* cells are unblocked until the file says otherwise */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 1 - params->halo; jj <= params->local_ny + params->halo; jj++)
+  {
+    for (int ii = 0; ii < params->pitch; ii++)
+    {
+      obstacles[ii + jj*params->pitch] = 0;
+    }
+  }
+
+  /* binary files start with OBSTACLESMAGIC, anything else is the text list */
+  fp = fopen(obstaclefile, "rb");
 
   if (fp == NULL)
   {
-    die("could not open file output file", __LINE__, __FILE__);
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
   }
 
-  for (int ii = 0; ii < params.maxIters; ii++)
+  if (fread(magic, 1, OBSTACLESMAGICLEN, fp) == OBSTACLESMAGICLEN
+      && memcmp(magic, OBSTACLESMAGIC, OBSTACLESMAGICLEN) == 0)
   {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+    fclose(fp);
+    return load_obstacles_binary(obstaclefile, params, obstacles);
   }
 
   fclose(fp);
-
-  return EXIT_SUCCESS;
+  return load_obstacles_text(obstaclefile, params, obstacles);
 }
 
-int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-             int** obstacles_ptr, float** av_vels_ptr)
+int load_obstacles_text(const char* obstaclefile, const t_param* params, uint8_t* obstacles)
 {
-  /*
-  ** free up allocated memory
-  */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
+  char   message[1024];  /* message buffer */
+  FILE*  fp;             /* file pointer */
+  int    xx, yy;         /* generic array indices */
+  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
+  int    retval;         /* to hold return value for checking */
 
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
+  /* open the obstacle data file */
+  fp = fopen(obstaclefile, "r");
 
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* read-in the blocked cells list, keeping the ones in this block and its halo rows */
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    /* some checks */
+    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+
+    if (xx < 0 || xx > params->nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+
+    if (yy < 0 || yy > params->ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+
+    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
+
+    /* global row yy is local row yy - row_offset + 1, or that +/- ny
+    ** in the halo rows across the periodic boundary in y */
+    for (int mm = -1; mm <= 1; mm++)
+    {
+      const int jj = yy - params->row_offset + 1 + mm*params->ny;
+      const int ii = xx - params->col_offset;
+
+      if (jj >= 1 - params->halo && jj <= params->local_ny + params->halo
+          && ii >= 0 && ii < params->local_nx)
+      {
+        obstacles[ii + jj*params->pitch] = blocked;
+      }
+    }
+  }
+
+  /* and close the file */
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int load_obstacles_binary(const char* obstaclefile, const t_param* params, uint8_t* obstacles)
+{
+  char          message[1024];  /* message buffer */
+  int           fd;             /* file descriptor */
+  struct stat   st;             /* for the file size */
+  int           dims[2];        /* nx, ny from the header */
+  const long    row_bytes = OBSTACLESROWBYTES(params->nx);
+  off_t         first;          /* file offset of this slab's first row */
+  off_t         map_start;      /* first, rounded down to a page */
+  size_t        map_len;        /* bytes mapped */
+  unsigned char* map;           /* the mapped rows */
+  const unsigned char* rows;    /* this slab's first row in the mapping */
+  unsigned char* halo_row;      /* one halo row, read on its own */
+
+  fd = open(obstaclefile, O_RDONLY);
+
+  if (fd < 0 || fstat(fd, &st) != 0)
+  {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (pread(fd, dims, sizeof(dims), OBSTACLESMAGICLEN) != (ssize_t)sizeof(dims))
+  {
+    die("could not read binary obstacle file header", __LINE__, __FILE__);
+  }
+
+  if (dims[0] != params->nx || dims[1] != params->ny)
+  {
+    sprintf(message, "obstacle file is %dx%d, parameter file %dx%d",
+            dims[0], dims[1], params->nx, params->ny);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if ((long long)st.st_size < OBSTACLESHEADER + (long long)row_bytes * params->ny)
+  {
+    die("binary obstacle file is truncated", __LINE__, __FILE__);
+  }
+
+  /* map only the rows of this slab; the offset mmap() takes must be page aligned */
+  first     = (off_t)OBSTACLESHEADER + (off_t)row_bytes * params->row_offset;
+  map_start = first - first % sysconf(_SC_PAGESIZE);
+  map_len   = (size_t)(first - map_start) + (size_t)row_bytes * params->local_ny;
+
+  map = mmap(NULL, map_len, PROT_READ, MAP_PRIVATE, fd, map_start);
+
+  if (map == MAP_FAILED) die("could not map binary obstacle file", __LINE__, __FILE__);
+
+  rows = map + (first - map_start);
+
+  /* unpack one bit per cell */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 1; jj <= params->local_ny; jj++)
+  {
+    const unsigned char* row = rows + (long)(jj - 1) * row_bytes;
+
+    for (int ii = 0; ii < params->local_nx; ii++)
+    {
+      const int xx = params->col_offset + ii;
+
+      obstacles[ii + jj*params->pitch] = (row[xx / 8] >> (xx % 8)) & 1;
+    }
+  }
+
+  munmap(map, map_len);
+
+  /* the few halo rows are read one at a time, they can wrap around in y */
+  halo_row = (unsigned char*)malloc((size_t)row_bytes);
+
+  if (halo_row == NULL) die("cannot allocate memory for obstacle row", __LINE__, __FILE__);
+
+  for (int hh = 0; hh < 2*params->halo; hh++)
+  {
+    const int jj = (hh < params->halo) ? hh + 1 - params->halo : params->local_ny + 1 + hh - params->halo;
+    const int yy = ((params->row_offset + jj - 1) % params->ny + params->ny) % params->ny;
+
+    if (pread(fd, halo_row, (size_t)row_bytes, (off_t)OBSTACLESHEADER + (off_t)row_bytes * yy) != (ssize_t)row_bytes)
+    {
+      die("could not read binary obstacle file", __LINE__, __FILE__);
+    }
+
+    for (int ii = 0; ii < params->local_nx; ii++)
+    {
+      const int xx = params->col_offset + ii;
+
+      obstacles[ii + jj*params->pitch] = (halo_row[xx / 8] >> (xx % 8)) & 1;
+    }
+  }
+
+  free(halo_row);
+  close(fd);
+
+  return EXIT_SUCCESS;
+}
+
+int tile_neighbour_blocked(const t_param* params, const uint8_t* obstacles, int ii, const int jj)
+{
+  /* with whole rows the ghost columns wrap around; the cells across a block
+  ** boundary are not in the mask, and count as fluid */
+  if (ii < 0 || ii >= params->local_nx)
+  {
+    if (params->local_nx != params->nx) return 0;
+
+    ii = (ii + params->local_nx) % params->local_nx;
+  }
+
+  return obstacles[ii + jj*params->pitch];
+}
+
+int build_obstacle_list(const t_param* params, const uint8_t* obstacles, t_obstacle_list* obstacle_list)
+{
+  int count = 0; /* blocked cells listed so far */
+  int spans = 0; /* spans so far */
+  const int first  = 1 - params->halo;                /* first halo row */
+  const int last   = params->local_ny + params->halo; /* last halo row */
+  const int ntiles = (params->local_nx + TILEWIDTH - 1) / TILEWIDTH; /* tiles per row */
+  uint8_t*  solid;  /* solid[tt + (jj - first)*ntiles] is 1 for a solid tile */
+
+  solid = (uint8_t*)malloc((size_t)(last - first + 1) * ntiles);
+  obstacle_list->row_start  = (int*)malloc(sizeof(int) * (last - first + 2));
+  obstacle_list->span_start = (int*)malloc(sizeof(int) * (last - first + 2));
+
+  if (solid == NULL || obstacle_list->row_start == NULL || obstacle_list->span_start == NULL)
+  {
+    die("cannot allocate memory for obstacle list", __LINE__, __FILE__);
+  }
+
+  obstacle_list->row_start  -= first;
+  obstacle_list->span_start -= first;
+  obstacle_list->count = 0;
+  obstacle_list->solid = 0;
+  obstacle_list->tiles = params->local_ny * ntiles;
+
+  /* a tile is solid if every cell it pulls from is blocked, itself
+  ** included; the first and last halo rows have no neighbours to check,
+  ** and are never updated anyway */
+  for (int jj = first; jj <= last; jj++)
+  {
+    for (int tt = 0; tt < ntiles; tt++)
+    {
+      const int lo = tt * TILEWIDTH;
+      const int hi = (lo + TILEWIDTH < params->local_nx) ? lo + TILEWIDTH : params->local_nx;
+      int is_solid = params->skip_solid && jj > first && jj < last;
+
+      for (int yy = jj - 1; yy <= jj + 1 && is_solid; yy++)
+      {
+        for (int ii = lo - 1; ii <= hi && is_solid; ii++)
+        {
+          is_solid = tile_neighbour_blocked(params, obstacles, ii, yy);
+        }
+      }
+
+      solid[tt + (jj - first)*ntiles] = (uint8_t)is_solid;
+
+      if (jj >= 1 && jj <= params->local_ny)
+      {
+        obstacle_list->solid += is_solid;
+
+        for (int ii = lo; ii < hi; ii++)
+        {
+          obstacle_list->count += obstacles[ii + jj*params->pitch];
+        }
+      }
+    }
+  }
+
+  /* count first, so cols and the spans can be allocated at their exact sizes */
+  obstacle_list->row_start[first]  = 0;
+  obstacle_list->span_start[first] = 0;
+
+  for (int jj = first; jj <= last; jj++)
+  {
+    for (int tt = 0; tt < ntiles; tt++)
+    {
+      if (solid[tt + (jj - first)*ntiles]) continue;
+
+      /* a span starts at each tile after a solid one */
+      if (tt == 0 || solid[tt - 1 + (jj - first)*ntiles]) spans++;
+
+      for (int ii = tt * TILEWIDTH; ii < (tt + 1) * TILEWIDTH && ii < params->local_nx; ii++)
+      {
+        count += obstacles[ii + jj*params->pitch];
+      }
+    }
+    obstacle_list->row_start[jj + 1]  = count;
+    obstacle_list->span_start[jj + 1] = spans;
+  }
+
+  obstacle_list->cols    = (int*)malloc(sizeof(int) * (count > 0 ? count : 1));
+  obstacle_list->span_lo = (int*)malloc(sizeof(int) * (spans > 0 ? spans : 1));
+  obstacle_list->span_hi = (int*)malloc(sizeof(int) * (spans > 0 ? spans : 1));
+
+  if (obstacle_list->cols == NULL || obstacle_list->span_lo == NULL || obstacle_list->span_hi == NULL)
+  {
+    die("cannot allocate memory for obstacle list", __LINE__, __FILE__);
+  }
+
+  count = 0;
+  spans = 0;
+
+  for (int jj = first; jj <= last; jj++)
+  {
+    for (int tt = 0; tt < ntiles; tt++)
+    {
+      const int lo = tt * TILEWIDTH;
+      const int hi = (lo + TILEWIDTH < params->local_nx) ? lo + TILEWIDTH : params->local_nx;
+
+      if (solid[tt + (jj - first)*ntiles]) continue;
+
+      if (tt == 0 || solid[tt - 1 + (jj - first)*ntiles]) obstacle_list->span_lo[spans++] = lo;
+
+      obstacle_list->span_hi[spans - 1] = hi;
+
+      for (int ii = lo; ii < hi; ii++)
+      {
+        if (obstacles[ii + jj*params->pitch]) obstacle_list->cols[count++] = ii;
+      }
+    }
+  }
+
+  free(solid);
+
+  return obstacle_list->count;
+}
+
+int timestep(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+             const t_obstacle_list* obstacle_list,
+             int up, int dn, t_pop* send_buff_up, t_pop* send_buff_dn,
+             t_pop* recv_buff_up, t_pop* recv_buff_dn, t_collision collide, float* tot_u,
+             t_timers* timers)
+{
+  MPI_Request requests[4]; /* halo messages in flight */
+
+  *tot_u = 0.f;
+
+  /* unless the last timestep's kernel already did it */
+  if (!params.accel_done) accelerate_flow(params, cells, obstacles);
+
+  #ifdef AA
+  /* odd timestep: the cells only read their own slots, but first the
+  ** densities the even one left in ghost columns and halo rows go home */
+  if (params.aa_swapped)
+  {
+    fold_ghost_columns(params, cells);
+    timer_lap(timers, PHASE_ACCELERATE);
+    halo_return_start(params, cells, up, dn, send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn, requests);
+    timer_lap(timers, PHASE_HALO);
+    collision_aa_odd(params, cells, tmp_cells, obstacles, obstacle_list, 2, params.local_ny - 1, tot_u);
+    timer_lap(timers, PHASE_COLLIDE);
+    halo_return_finish(params, cells, recv_buff_up, recv_buff_dn, requests);
+    timer_lap(timers, PHASE_HALO);
+
+    collision_aa_odd(params, cells, tmp_cells, obstacles, obstacle_list, 1, 1, tot_u);
+    if (params.local_ny > 1) collision_aa_odd(params, cells, tmp_cells, obstacles, obstacle_list, params.local_ny, params.local_ny, tot_u);
+    timer_lap(timers, PHASE_COLLIDE);
+
+    return EXIT_SUCCESS;
+  }
+  #endif
+
+  /* x wrap around: a local copy, or from the blocks west and east (using the halo
+  ** buffers, which are free again before halo_start() packs them) */
+  if (params.proc_cols > 1)
+  {
+    timer_lap(timers, PHASE_ACCELERATE);
+    column_exchange(params, cells, send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn);
+    timer_lap(timers, PHASE_HALO);
+  }
+  else
+  {
+    fill_ghost_columns(params, cells);
+    timer_lap(timers, PHASE_ACCELERATE);
+  }
+
+  /* interior rows 2..local_ny-1 only read slab rows, so update them
+  ** while the halo rows are on their way */
+  halo_start(params, cells, up, dn, send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn, requests);
+  timer_lap(timers, PHASE_HALO);
+  collide(params, cells, tmp_cells, obstacles, obstacle_list, 2, params.local_ny - 1, tot_u);
+  timer_lap(timers, PHASE_COLLIDE);
+  halo_finish(params, cells, recv_buff_up, recv_buff_dn, requests);
+  timer_lap(timers, PHASE_HALO);
+
+  /* edge rows need the halos (a one-row slab is its own top and bottom) */
+  collide(params, cells, tmp_cells, obstacles, obstacle_list, 1, 1, tot_u);
+  if (params.local_ny > 1) collide(params, cells, tmp_cells, obstacles, obstacle_list, params.local_ny, params.local_ny, tot_u);
+  timer_lap(timers, PHASE_COLLIDE);
+
+  return EXIT_SUCCESS;
+}
+
+int timestep_blocked(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                     const t_obstacle_list* obstacle_list, const int depth,
+                     int up, int dn, t_pop* send_buff_up, t_pop* send_buff_dn,
+                     t_pop* recv_buff_up, t_pop* recv_buff_dn, t_collision collide,
+                     float* tot_u, t_timers* timers)
+{
+  MPI_Request requests[4];               /* halo messages in flight */
+  t_speed* grids[2] = { cells, tmp_cells }; /* time level ss of the block is in grids[ss % 2] */
+
+  /*
+  ** step ss of the block (0..depth-1) only has to be right for rows
+  ** 1 - (depth-1-ss)..local_ny + (depth-1-ss): the halo rows are updated
+  ** redundantly, as their owners do, until the next exchange
+  **
+  ** wavefront: at position rr, step ss updates row rr - 2*ss, so
+  ** - the rows it pulls from (time ss) were finished at earlier positions
+  ** - the row it overwrites in the other grid (time ss - 1) has been read
+  **   by all three of its neighbours
+  ** - the (at most depth) updates at one position are independent of each
+  **   other and are shared out between threads, one row each
+  ** so the rows stay in cache from one step of the block to the next,
+  ** and the results are the same as depth calls to timestep()
+  */
+  /* time level 0 of the halo rows, then the forcing on every copy of a forced row */
+  fill_ghost_columns(params, cells);
+  timer_lap(timers, PHASE_ACCELERATE);
+  halo_start(params, cells, up, dn, send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn, requests);
+  halo_finish(params, cells, recv_buff_up, recv_buff_dn, requests);
+  timer_lap(timers, PHASE_HALO);
+
+  for (int jj = 1 - depth; jj <= params.local_ny + depth; jj++)
+  {
+    if (!params.accel_rows[jj]) continue;
+
+    accelerate_row(params, cells, obstacles, jj);
+    fill_ghost_row(params, cells, jj);
+  }
+
+  timer_lap(timers, PHASE_ACCELERATE);
+
+  for (int ss = 0; ss < depth; ss++)
+  {
+    tot_u[ss] = 0.f;
+  }
+
+  for (int rr = 2 - depth; rr <= params.local_ny + 2*depth - 2; rr++)
+  {
+    /* forcing of the later steps, just before the first update that reads the row */
+    for (int ss = 1; ss < depth; ss++)
+    {
+      const int jj = rr + 1 - 2*ss; /* the row that is read first at this position */
+
+      if (jj >= 1 - (depth - ss) && jj <= params.local_ny + depth - ss && params.accel_rows[jj])
+      {
+        accelerate_row(params, grids[ss % 2], obstacles, jj);
+        fill_ghost_row(params, grids[ss % 2], jj);
+      }
+    }
+
+    /* the kernels' own row loops run on one thread inside this one */
+    #pragma omp parallel for schedule(static)
+    for (int ss = 0; ss < depth; ss++)
+    {
+      const int jj = rr - 2*ss;
+
+      float row_u = 0.f; /* this row's velocity norms */
+
+      if (jj < 1 - (depth - 1 - ss) || jj > params.local_ny + (depth - 1 - ss)) continue;
+
+      collide(params, grids[ss % 2], grids[(ss + 1) % 2], obstacles, obstacle_list, jj, jj, &row_u);
+      fill_ghost_row(params, grids[(ss + 1) % 2], jj);
+
+      /* slab rows only, the halo rows are their owners' */
+      if (jj >= 1 && jj <= params.local_ny) tot_u[ss] += row_u;
+    }
+  }
+
+  /* the later steps' forcing is done inside the wavefront, and counted with it */
+  timer_lap(timers, PHASE_COLLIDE);
+
+  return EXIT_SUCCESS;
+}
+
+int accelerate_flow(const t_param params, t_speed* cells, uint8_t* obstacles)
+{
+  /* modify the forced rows of the grid (the 2nd row from the top by default)
+  ** - only the ranks whose slabs hold one have anything to do
+  ** - the rows are independent, so many of them (--accel-rows=all) are shared out */
+  if (params.accel_local == 0) return EXIT_SUCCESS;
+
+  #pragma omp parallel for schedule(static) if (params.accel_local > 1)
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    if (params.accel_rows[jj]) accelerate_row(params, cells, obstacles, jj);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static inline void accelerate_row(const t_param params, t_speed* cells, const uint8_t* obstacles,
+                                  const int jj)
+{
+  /* compute weighting factors */
+  float w1 = params.density * params.accel / 9.f;
+  float w2 = params.density * params.accel / 36.f;
+
+  for (int ii = 0; ii < params.local_nx; ii++)
+  {
+    /* the densities that are moved */
+    const float s1 = POP_GET(params, STATE(cells, params, ii, jj, 1), 1);
+    const float s3 = POP_GET(params, STATE(cells, params, ii, jj, 3), 3);
+    const float s5 = POP_GET(params, STATE(cells, params, ii, jj, 5), 5);
+    const float s6 = POP_GET(params, STATE(cells, params, ii, jj, 6), 6);
+    const float s7 = POP_GET(params, STATE(cells, params, ii, jj, 7), 7);
+    const float s8 = POP_GET(params, STATE(cells, params, ii, jj, 8), 8);
+
+    /* if the cell is not occupied and
+    ** we don't send a negative density */
+    if (!obstacles[ii + jj*params.pitch]
+        && (s3 - w1) > 0.f
+        && (s6 - w2) > 0.f
+        && (s7 - w2) > 0.f)
+    {
+      /* increase 'east-side' densities */
+      STATE(cells, params, ii, jj, 1) = POP_PUT(params, s1 + w1, 1);
+      STATE(cells, params, ii, jj, 5) = POP_PUT(params, s5 + w2, 5);
+      STATE(cells, params, ii, jj, 8) = POP_PUT(params, s8 + w2, 8);
+      /* decrease 'west-side' densities */
+      STATE(cells, params, ii, jj, 3) = POP_PUT(params, s3 - w1, 3);
+      STATE(cells, params, ii, jj, 6) = POP_PUT(params, s6 - w2, 6);
+      STATE(cells, params, ii, jj, 7) = POP_PUT(params, s7 - w2, 7);
+    }
+  }
+}
+
+int fill_ghost_columns(const t_param params, t_speed* cells)
+{
+  /* periodic wrap around in x, halo rows get theirs from the exchange */
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    fill_ghost_row(params, cells, jj);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+static inline void fill_ghost_row(const t_param params, t_speed* cells, const int jj)
+{
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    SPEED(cells, -1 + jj*params.pitch, kk)       = SPEED(cells, params.local_nx - 1 + jj*params.pitch, kk);
+    SPEED(cells, params.local_nx + jj*params.pitch, kk) = SPEED(cells, jj*params.pitch, kk);
+  }
+}
+
+/* densities a ghost column carries: those of the edge columns that cross into the neighbour */
+static const int COL_TO_E[3] = { 1, 5, 8 }; /* column local_nx - 1, to rank right's ghost column -1 */
+static const int COL_TO_W[3] = { 3, 6, 7 }; /* column 0, to rank left's ghost column local_nx */
+
+int column_exchange(const t_param params, t_speed* cells, t_pop* send_buff_w, t_pop* send_buff_e,
+                    t_pop* recv_buff_w, t_pop* recv_buff_e)
+{
+  MPI_Request requests[4]; /* column messages in flight */
+  const int slot_count = params.local_ny;  /* values per density per message */
+  const int count      = 3 * slot_count;   /* values per message */
+
+  /* slab rows only, slot-major like the halo rows */
+  for (int ss = 0; ss < 3; ss++)
+  {
+    for (int jj = 1; jj <= params.local_ny; jj++)
+    {
+      send_buff_e[ss*slot_count + jj - 1] = SPEED(cells, params.local_nx - 1 + jj*params.pitch, COL_TO_E[ss]);
+      send_buff_w[ss*slot_count + jj - 1] = SPEED(cells, jj*params.pitch, COL_TO_W[ss]);
+    }
+  }
+
+  MPI_Irecv(recv_buff_w, count, MPI_POP, params.left, 4, params.comm, &requests[0]);
+  MPI_Irecv(recv_buff_e, count, MPI_POP, params.right, 5, params.comm, &requests[1]);
+  MPI_Isend(send_buff_e, count, MPI_POP, params.right, 4, params.comm, &requests[2]);
+  MPI_Isend(send_buff_w, count, MPI_POP, params.left, 5, params.comm, &requests[3]);
+  MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+  for (int ss = 0; ss < 3; ss++)
+  {
+    for (int jj = 1; jj <= params.local_ny; jj++)
+    {
+      SPEED(cells, -1 + jj*params.pitch, COL_TO_E[ss])             = recv_buff_w[ss*slot_count + jj - 1];
+      SPEED(cells, params.local_nx + jj*params.pitch, COL_TO_W[ss]) = recv_buff_e[ss*slot_count + jj - 1];
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+/*
+** densities a halo row carries: rows 1 - halo..0 are only read by the
+** pulls of row 1 from below (2, 5, 6), rows local_ny + 1.. by those of
+** row local_ny from above (4, 7, 8), unless the halo is deeper than one
+** row and updated itself
+*/
+static const int HALO_ALL[NSPEEDS] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 };
+static const int HALO_TO_UP[3]     = { 4, 7, 8 }; /* first slab rows, to rank up's top halo */
+static const int HALO_TO_DN[3]     = { 2, 5, 6 }; /* last slab rows, to rank dn's bottom halo */
+
+int halo_start(const t_param params, t_speed* cells, int up, int dn,
+               t_pop* send_buff_up, t_pop* send_buff_dn,
+               t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests)
+{
+  const int  nslots  = (params.halo == 1) ? 3 : NSPEEDS;
+  const int* to_up   = (params.halo == 1) ? HALO_TO_UP : HALO_ALL;
+  const int* to_dn   = (params.halo == 1) ? HALO_TO_DN : HALO_ALL;
+  const int row_count = params.local_nx + 2;                 /* cells per halo row, ghost columns included */
+  const int slot_count = row_count * params.halo;      /* floats per density per message */
+  const int count     = slot_count * nslots;           /* floats per message */
+
+  /*
+  ** halo rows for the local grid
+  ** - rows 1 - halo..0 mirror the last halo slab rows of rank up
+  ** - rows local_ny + 1..local_ny + halo mirror the first halo slab rows of rank dn
+  ** - pack send buffers using grid values, one density at a time so the
+  **   SOA planes are copied row by row
+  ** - post MPI_Irecv()/MPI_Isend() for both directions
+  ** - columns -1..local_nx, so the halo rows arrive with their ghost columns
+  ** halo_finish() waits and unpacks the receive buffers into the grid
+  */
+  for (int ss = 0; ss < nslots; ss++)
+  {
+    for (int hh = 0; hh < params.halo; hh++)
+    {
+      t_pop* up_row = send_buff_up + ss*slot_count + hh*row_count + 1;
+      t_pop* dn_row = send_buff_dn + ss*slot_count + hh*row_count + 1;
+
+      for (int ii = -1; ii <= params.local_nx; ii++)
+      {
+        up_row[ii] = SPEED(cells, ii + (1 + hh)*params.pitch, to_up[ss]);
+        dn_row[ii] = SPEED(cells, ii + (params.local_ny - params.halo + 1 + hh)*params.pitch, to_dn[ss]);
+      }
+    }
+  }
+
+  /* receives first, so the messages can land straight in the buffers */
+  MPI_Irecv(recv_buff_dn, count, MPI_POP, dn, 0, params.comm, &requests[0]);
+  MPI_Irecv(recv_buff_up, count, MPI_POP, up, 1, params.comm, &requests[1]);
+  /* send above, receive below */
+  MPI_Isend(send_buff_up, count, MPI_POP, up, 0, params.comm, &requests[2]);
+  /* send below, receive above */
+  MPI_Isend(send_buff_dn, count, MPI_POP, dn, 1, params.comm, &requests[3]);
+
+  return EXIT_SUCCESS;
+}
+
+int halo_finish(const t_param params, t_speed* cells,
+                t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests)
+{
+  const int  nslots  = (params.halo == 1) ? 3 : NSPEEDS;
+  const int* from_dn = (params.halo == 1) ? HALO_TO_UP : HALO_ALL; /* what rank dn sent up */
+  const int* from_up = (params.halo == 1) ? HALO_TO_DN : HALO_ALL;
+  const int row_count = params.local_nx + 2;
+  const int slot_count = row_count * params.halo;
+
+  /* the send buffers are reused next timestep, so wait for those too */
+  MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+  for (int ss = 0; ss < nslots; ss++)
+  {
+    for (int hh = 0; hh < params.halo; hh++)
+    {
+      const t_pop* dn_row = recv_buff_dn + ss*slot_count + hh*row_count + 1;
+      const t_pop* up_row = recv_buff_up + ss*slot_count + hh*row_count + 1;
+
+      for (int ii = -1; ii <= params.local_nx; ii++)
+      {
+        SPEED(cells, ii + (params.local_ny + 1 + hh)*params.pitch, from_dn[ss]) = dn_row[ii];
+        SPEED(cells, ii + (1 - params.halo + hh)*params.pitch, from_up[ss])     = up_row[ii];
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+#ifdef OFFLOAD
+#pragma omp declare target
+#endif
+static inline float relax_speeds(const t_param params, float speeds[NSPEEDS])
+{
+  const float c_sq = 1.f / 3.f; /* square of speed of sound */
+  const float w0 = 4.f / 9.f;  /* weighting factor */
+  const float w1 = 1.f / 9.f;  /* weighting factor */
+  const float w2 = 1.f / 36.f; /* weighting factor */
+
+  /* compute local density total */
+  float local_density = 0.f;
+
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    local_density += speeds[kk];
+  }
+
+  /* compute x velocity component */
+  float u_x = (speeds[1]
+                + speeds[5]
+                + speeds[8]
+                - (speeds[3]
+                   + speeds[6]
+                   + speeds[7]))
+               / local_density;
+  /* compute y velocity component */
+  float u_y = (speeds[2]
+                + speeds[5]
+                + speeds[6]
+                - (speeds[4]
+                   + speeds[7]
+                   + speeds[8]))
+               / local_density;
+
+  /* velocity squared */
+  float u_sq = u_x * u_x + u_y * u_y;
+
+  /* directional velocity components */
+  float u[NSPEEDS];
+  u[1] =   u_x;        /* east */
+  u[2] =         u_y;  /* north */
+  u[3] = - u_x;        /* west */
+  u[4] =       - u_y;  /* south */
+  u[5] =   u_x + u_y;  /* north-east */
+  u[6] = - u_x + u_y;  /* north-west */
+  u[7] = - u_x - u_y;  /* south-west */
+  u[8] =   u_x - u_y;  /* south-east */
+
+  /* equilibrium densities */
+  float d_equ[NSPEEDS];
+  /* zero velocity density: weight w0 */
+  d_equ[0] = w0 * local_density
+             * (1.f - u_sq / (2.f * c_sq));
+  /* axis speeds: weight w1 */
+  d_equ[1] = w1 * local_density * (1.f + u[1] / c_sq
+                                   + (u[1] * u[1]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+  d_equ[2] = w1 * local_density * (1.f + u[2] / c_sq
+                                   + (u[2] * u[2]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+  d_equ[3] = w1 * local_density * (1.f + u[3] / c_sq
+                                   + (u[3] * u[3]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+  d_equ[4] = w1 * local_density * (1.f + u[4] / c_sq
+                                   + (u[4] * u[4]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+  /* diagonal speeds: weight w2 */
+  d_equ[5] = w2 * local_density * (1.f + u[5] / c_sq
+                                   + (u[5] * u[5]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+  d_equ[6] = w2 * local_density * (1.f + u[6] / c_sq
+                                   + (u[6] * u[6]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+  d_equ[7] = w2 * local_density * (1.f + u[7] / c_sq
+                                   + (u[7] * u[7]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+  d_equ[8] = w2 * local_density * (1.f + u[8] / c_sq
+                                   + (u[8] * u[8]) / (2.f * c_sq * c_sq)
+                                   - u_sq / (2.f * c_sq));
+
+  /* relaxation step */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    speeds[kk] += params.omega * (d_equ[kk] - speeds[kk]);
+  }
+
+  /* the relaxed densities have the same density and velocity */
+  return sqrtf(u_sq);
+}
+#ifdef OFFLOAD
+#pragma omp end declare target
+#endif
+
+static inline float collision_cell(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                   const int ii, const int jj)
+{
+  /* determine indices of axis-direction neighbours
+  ** - periodic wrap around is handled by the ghost columns (x)
+  **   and the halo exchange (y) */
+  const int y_n = jj + 1;
+  const int x_e = ii + 1;
+  const int y_s = jj - 1;
+  const int x_w = ii - 1;
+
+  /* propagate: pull densities from neighbouring cells, following
+  ** appropriate directions of travel */
+  float speeds[NSPEEDS];
+  speeds[0] = POP_GET(params, SPEED(cells, ii + jj*params.pitch, 0), 0);   /* central cell, no movement */
+  speeds[1] = POP_GET(params, SPEED(cells, x_w + jj*params.pitch, 1), 1);  /* east */
+  speeds[2] = POP_GET(params, SPEED(cells, ii + y_s*params.pitch, 2), 2);  /* north */
+  speeds[3] = POP_GET(params, SPEED(cells, x_e + jj*params.pitch, 3), 3);  /* west */
+  speeds[4] = POP_GET(params, SPEED(cells, ii + y_n*params.pitch, 4), 4);  /* south */
+  speeds[5] = POP_GET(params, SPEED(cells, x_w + y_s*params.pitch, 5), 5); /* north-east */
+  speeds[6] = POP_GET(params, SPEED(cells, x_e + y_s*params.pitch, 6), 6); /* north-west */
+  speeds[7] = POP_GET(params, SPEED(cells, x_e + y_n*params.pitch, 7), 7); /* south-west */
+  speeds[8] = POP_GET(params, SPEED(cells, x_w + y_n*params.pitch, 8), 8); /* south-east */
+
+  /* collision: relax towards equilibrium, blocked cells included
+  ** (rebound_row() overwrites those afterwards) */
+  const float u = relax_speeds(params, speeds);
+
+  /* writing into the other grid */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    SPEED(tmp_cells, ii + jj*params.pitch, kk) = POP_PUT(params, speeds[kk], kk);
+  }
+
+  return u;
+}
+
+static inline void rebound_row(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                               const t_obstacle_list* obstacle_list, const int jj)
+{
+  const int y_n = jj + 1; /* wrap around is handled by halo rows and ghost columns */
+  const int y_s = jj - 1;
+
+  for (int oo = obstacle_list->row_start[jj]; oo < obstacle_list->row_start[jj + 1]; oo++)
+  {
+    const int ii  = obstacle_list->cols[oo];
+    const int x_e = ii + 1;
+    const int x_w = ii - 1;
+
+    /* pull the densities and mirror them */
+    SPEED(tmp_cells, ii + jj*params.pitch, 0) = SPEED(cells, ii + jj*params.pitch, 0);
+    SPEED(tmp_cells, ii + jj*params.pitch, 1) = SPEED(cells, x_e + jj*params.pitch, 3);
+    SPEED(tmp_cells, ii + jj*params.pitch, 2) = SPEED(cells, ii + y_n*params.pitch, 4);
+    SPEED(tmp_cells, ii + jj*params.pitch, 3) = SPEED(cells, x_w + jj*params.pitch, 1);
+    SPEED(tmp_cells, ii + jj*params.pitch, 4) = SPEED(cells, ii + y_s*params.pitch, 2);
+    SPEED(tmp_cells, ii + jj*params.pitch, 5) = SPEED(cells, x_e + y_n*params.pitch, 7);
+    SPEED(tmp_cells, ii + jj*params.pitch, 6) = SPEED(cells, x_w + y_n*params.pitch, 8);
+    SPEED(tmp_cells, ii + jj*params.pitch, 7) = SPEED(cells, x_w + y_s*params.pitch, 5);
+    SPEED(tmp_cells, ii + jj*params.pitch, 8) = SPEED(cells, x_e + y_s*params.pitch, 6);
+  }
+}
+
+static inline int row_unbroken(const t_param params, const t_obstacle_list* obstacle_list, const int jj)
+{
+  const int ss = obstacle_list->span_start[jj];
+
+  return obstacle_list->span_start[jj + 1] == ss + 1
+         && obstacle_list->span_lo[ss] == 0 && obstacle_list->span_hi[ss] == params.local_nx;
+}
+
+static inline float collision_span(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                   const uint8_t* obstacles, const int jj, const int lo, const int hi)
+{
+  float span_u = 0.f;
+
+  for (int ii = lo; ii < hi; ii++)
+  {
+    span_u += (float)(1 - obstacles[ii + jj*params.pitch]) * collision_cell(params, cells, tmp_cells, ii, jj);
+  }
+
+  return span_u;
+}
+
+static inline float collision_row(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                                  const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                                  const int jj)
+{
+  float row_u = 0.f; /* velocity norms of the fluid cells */
+
+  /* blocked cells contribute zero, as in av_velocity_row(); rows without
+  ** solid tiles keep the plain loop, over a constant local_nx in the
+  ** specialised kernels */
+  if (row_unbroken(params, obstacle_list, jj))
+  {
+    for (int ii = 0; ii < params.local_nx; ii++)
+    {
+      row_u += (float)(1 - obstacles[ii + jj*params.pitch]) * collision_cell(params, cells, tmp_cells, ii, jj);
+    }
+  }
+  else
+  {
+    for (int ss = obstacle_list->span_start[jj]; ss < obstacle_list->span_start[jj + 1]; ss++)
+    {
+      row_u += collision_span(params, cells, tmp_cells, obstacles, jj,
+                              obstacle_list->span_lo[ss], obstacle_list->span_hi[ss]);
+    }
+  }
+
+  rebound_row(params, cells, tmp_cells, obstacle_list, jj);
+
+  /* the next timestep's forcing, while the row is in cache; u is the norm before it */
+  if (params.accel_fold && params.accel_rows[jj]) accelerate_row(params, tmp_cells, obstacles, jj);
+
+  return row_u;
+}
+
+int collision(const t_param params, t_speed* cells, t_speed* tmp_cells,
+              const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+              int jj_start, int jj_end, float* tot_u)
+{
+  float rows_u = 0.f; /* velocity norms of rows jj_start..jj_end */
+
+  /* loop over the cells in slab rows jj_start..jj_end, halo rows supply the y-neighbours
+  ** - rows are shared out between threads */
+  #pragma omp parallel for schedule(static) reduction(+:rows_u)
+  for (int jj = jj_start; jj <= jj_end; jj++)
+  {
+    rows_u += collision_row(params, cells, tmp_cells, obstacles, obstacle_list, jj);
+  }
+
+  *tot_u += rows_u;
+
+  return EXIT_SUCCESS;
+}
+
+#ifndef AA
+/* the scalar kernel for each fixed shape */
+#define SHAPE(id, nx, omega) SPECIALISED_KERNEL(collision_##id, collision_row, nx, omega)
+#include "d2q9-bgk_shapes.h"
+#undef SHAPE
+
+static const t_shape_kernel collision_shapes[] = {
+#define SHAPE(id, nx, omega) { nx, omega, collision_##id },
+#include "d2q9-bgk_shapes.h"
+#undef SHAPE
+  { 0, 0.f, NULL }
+};
+#endif
+
+#ifdef AA
+int collision_aa_even(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                      const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                      int jj_start, int jj_end, float* tot_u)
+{
+  float rows_u = 0.f; /* velocity norms of the fluid cells (the blocked ones are skipped) */
+
+  /* every slot is read and written by exactly one cell, so rows can still be shared out */
+  #pragma omp parallel for schedule(static) reduction(+:rows_u)
+  for (int jj = jj_start; jj <= jj_end; jj++)
+  {
+    const int y_n = jj + 1; /* wrap around is handled by halo rows and ghost columns */
+    const int y_s = jj - 1;
+    int oo = obstacle_list->row_start[jj]; /* next blocked cell of this row */
+
+    /* the solid tiles between the spans have no cells to update */
+    for (int ss = obstacle_list->span_start[jj]; ss < obstacle_list->span_start[jj + 1]; ss++)
+    {
+      for (int ii = obstacle_list->span_lo[ss]; ii < obstacle_list->span_hi[ss]; ii++)
+      {
+        const int x_e = ii + 1;
+        const int x_w = ii - 1;
+
+        if (oo < obstacle_list->row_start[jj + 1] && obstacle_list->cols[oo] == ii)
+        {
+          oo++;
+          continue;
+        }
+
+        /* propagate: pull densities from neighbouring cells */
+        float speeds[NSPEEDS];
+        speeds[0] = POP_GET(params, SPEED(cells, ii + jj*params.pitch, 0), 0);   /* central cell, no movement */
+        speeds[1] = POP_GET(params, SPEED(cells, x_w + jj*params.pitch, 1), 1);  /* east */
+        speeds[2] = POP_GET(params, SPEED(cells, ii + y_s*params.pitch, 2), 2);  /* north */
+        speeds[3] = POP_GET(params, SPEED(cells, x_e + jj*params.pitch, 3), 3);  /* west */
+        speeds[4] = POP_GET(params, SPEED(cells, ii + y_n*params.pitch, 4), 4);  /* south */
+        speeds[5] = POP_GET(params, SPEED(cells, x_w + y_s*params.pitch, 5), 5); /* north-east */
+        speeds[6] = POP_GET(params, SPEED(cells, x_e + y_s*params.pitch, 6), 6); /* north-west */
+        speeds[7] = POP_GET(params, SPEED(cells, x_e + y_n*params.pitch, 7), 7); /* south-west */
+        speeds[8] = POP_GET(params, SPEED(cells, x_w + y_n*params.pitch, 8), 8); /* south-east */
+
+        rows_u += relax_speeds(params, speeds);
+
+        /* write back to the slots just read: density kk goes one step
+        ** downstream, into the slot of the opposite direction (which has
+        ** the same rest value) */
+        SPEED(cells, ii + jj*params.pitch, 0)  = POP_PUT(params, speeds[0], 0);
+        SPEED(cells, x_e + jj*params.pitch, 3)  = POP_PUT(params, speeds[1], 1);
+        SPEED(cells, ii + y_n*params.pitch, 4)  = POP_PUT(params, speeds[2], 2);
+        SPEED(cells, x_w + jj*params.pitch, 1)  = POP_PUT(params, speeds[3], 3);
+        SPEED(cells, ii + y_s*params.pitch, 2)  = POP_PUT(params, speeds[4], 4);
+        SPEED(cells, x_e + y_n*params.pitch, 7) = POP_PUT(params, speeds[5], 5);
+        SPEED(cells, x_w + y_n*params.pitch, 8) = POP_PUT(params, speeds[6], 6);
+        SPEED(cells, x_w + y_s*params.pitch, 5) = POP_PUT(params, speeds[7], 7);
+        SPEED(cells, x_e + y_s*params.pitch, 6) = POP_PUT(params, speeds[8], 8);
+      }
+    }
+  }
+
+  *tot_u += rows_u;
+
+  return EXIT_SUCCESS;
+}
+
+int collision_aa_odd(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                     const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                     int jj_start, int jj_end, float* tot_u)
+{
+  float rows_u = 0.f; /* velocity norms of the fluid cells */
+
+  #pragma omp parallel for schedule(static) reduction(+:rows_u)
+  for (int jj = jj_start; jj <= jj_end; jj++)
+  {
+    int oo = obstacle_list->row_start[jj]; /* next blocked cell of this row */
+
+    /* the solid tiles between the spans have no cells to update */
+    for (int ss = obstacle_list->span_start[jj]; ss < obstacle_list->span_start[jj + 1]; ss++)
+    {
+      for (int ii = obstacle_list->span_lo[ss]; ii < obstacle_list->span_hi[ss]; ii++)
+      {
+        if (oo < obstacle_list->row_start[jj + 1] && obstacle_list->cols[oo] == ii)
+        {
+          oo++;
+          continue;
+        }
+
+        /* the even timestep left the propagated densities in the opposite slots */
+        float speeds[NSPEEDS];
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          speeds[kk] = POP_GET(params, SPEED(cells, ii + jj*params.pitch, AA_OPP[kk]), kk);
+        }
+
+        rows_u += relax_speeds(params, speeds);
+
+        for (int kk = 0; kk < NSPEEDS; kk++)
+        {
+          SPEED(cells, ii + jj*params.pitch, kk) = POP_PUT(params, speeds[kk], kk);
+        }
+      }
+    }
+  }
+
+  *tot_u += rows_u;
+
+  return EXIT_SUCCESS;
+}
+
+int fold_ghost_columns(const t_param params, t_speed* cells)
+{
+  /* column 0 wrote its westward densities into ghost column -1 (slots 1, 5, 8),
+  ** column local_nx - 1 its eastward ones into ghost column local_nx (slots 3, 6, 7);
+  ** halo rows too, they are returned to their owners next */
+  for (int jj = 0; jj <= params.local_ny + 1; jj++)
+  {
+    SPEED(cells, params.local_nx - 1 + jj*params.pitch, 1) = SPEED(cells, -1 + jj*params.pitch, 1);
+    SPEED(cells, params.local_nx - 1 + jj*params.pitch, 5) = SPEED(cells, -1 + jj*params.pitch, 5);
+    SPEED(cells, params.local_nx - 1 + jj*params.pitch, 8) = SPEED(cells, -1 + jj*params.pitch, 8);
+    SPEED(cells, jj*params.pitch, 3) = SPEED(cells, params.local_nx + jj*params.pitch, 3);
+    SPEED(cells, jj*params.pitch, 6) = SPEED(cells, params.local_nx + jj*params.pitch, 6);
+    SPEED(cells, jj*params.pitch, 7) = SPEED(cells, params.local_nx + jj*params.pitch, 7);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int halo_return_start(const t_param params, t_speed* cells, int up, int dn,
+                      t_pop* send_buff_up, t_pop* send_buff_dn,
+                      t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests)
+{
+  const int count = 3 * params.local_nx; /* the three densities crossing each halo row */
+
+  /*
+  ** the reverse of halo_start(): row 0 holds (slots 2, 5, 6) what row 1
+  ** sent south into rank up's last row, row local_ny + 1 (slots 4, 7, 8)
+  ** what row local_ny sent north into rank dn's first row
+  */
+  for (int ii = 0; ii < params.local_nx; ii++)
+  {
+    send_buff_up[3*ii]     = SPEED(cells, ii, 2);
+    send_buff_up[3*ii + 1] = SPEED(cells, ii, 5);
+    send_buff_up[3*ii + 2] = SPEED(cells, ii, 6);
+    send_buff_dn[3*ii]     = SPEED(cells, ii + (params.local_ny + 1)*params.pitch, 4);
+    send_buff_dn[3*ii + 1] = SPEED(cells, ii + (params.local_ny + 1)*params.pitch, 7);
+    send_buff_dn[3*ii + 2] = SPEED(cells, ii + (params.local_ny + 1)*params.pitch, 8);
+  }
+
+  MPI_Irecv(recv_buff_dn, count, MPI_POP, dn, 2, params.comm, &requests[0]);
+  MPI_Irecv(recv_buff_up, count, MPI_POP, up, 3, params.comm, &requests[1]);
+  MPI_Isend(send_buff_up, count, MPI_POP, up, 2, params.comm, &requests[2]);
+  MPI_Isend(send_buff_dn, count, MPI_POP, dn, 3, params.comm, &requests[3]);
+
+  return EXIT_SUCCESS;
+}
+
+int halo_return_finish(const t_param params, t_speed* cells,
+                       t_pop* recv_buff_up, t_pop* recv_buff_dn, MPI_Request* requests)
+{
+  MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+  for (int ii = 0; ii < params.local_nx; ii++)
+  {
+    SPEED(cells, ii + params.local_ny*params.pitch, 2) = recv_buff_dn[3*ii];
+    SPEED(cells, ii + params.local_ny*params.pitch, 5) = recv_buff_dn[3*ii + 1];
+    SPEED(cells, ii + params.local_ny*params.pitch, 6) = recv_buff_dn[3*ii + 2];
+    SPEED(cells, ii + params.pitch, 4) = recv_buff_up[3*ii];
+    SPEED(cells, ii + params.pitch, 7) = recv_buff_up[3*ii + 1];
+    SPEED(cells, ii + params.pitch, 8) = recv_buff_up[3*ii + 2];
+  }
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+#ifdef OFFLOAD
+int offload_enter(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                  t_pop* send_buff_up, t_pop* send_buff_dn, t_pop* recv_buff_up, t_pop* recv_buff_dn,
+                  float* row_u, float* tot_u_dev, const int batch)
+{
+  MPI_Comm node;                              /* the ranks sharing this node */
+  int node_rank;                              /* this rank's place on the node */
+  const int devices = omp_get_num_devices();  /* none: the target regions run on the host */
+  t_pop* c = GRIDBLOCK(cells);
+  t_pop* t = GRIDBLOCK(tmp_cells);
+  const int n     = NSPEEDS * GRIDPLANE(cells);           /* floats per grid */
+  const int count = NSPEEDS * (params.local_nx + 2);            /* floats per halo message */
+  const int mask  = (params.local_ny + 2) * params.pitch; /* obstacle mask, halo rows included */
+
+  (void)c; (void)t; /* only referenced by the map clauses */
+
+  /* one device per rank on each node, shared round robin if there are fewer */
+  MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, MPI_INFO_NULL, &node);
+  MPI_Comm_rank(node, &node_rank);
+  MPI_Comm_free(&node);
+
+  if (devices > 0) omp_set_default_device(node_rank % devices);
+
+  /* only the initial state and the geometry are copied, the rest is filled on the device */
+  #pragma omp target enter data map(to: c[0:n], obstacles[0:mask]) \
+          map(alloc: t[0:n], send_buff_up[0:count], send_buff_dn[0:count], \
+                     recv_buff_up[0:count], recv_buff_dn[0:count], \
+                     row_u[0:params.local_ny + 2], tot_u_dev[0:batch])
+
+  return EXIT_SUCCESS;
+}
+
+int offload_exit(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                 t_pop* send_buff_up, t_pop* send_buff_dn, t_pop* recv_buff_up, t_pop* recv_buff_dn,
+                 float* row_u, float* tot_u_dev, const int batch)
+{
+  t_pop* c = GRIDBLOCK(cells);
+  t_pop* t = GRIDBLOCK(tmp_cells);
+  const int n     = NSPEEDS * GRIDPLANE(cells);
+  const int count = NSPEEDS * (params.local_nx + 2);
+  const int mask  = (params.local_ny + 2) * params.pitch;
+
+  (void)c; (void)t; /* only referenced by the map clauses */
+
+  /* the final state is the only copy back */
+  #pragma omp target exit data map(from: c[0:n]) \
+          map(delete: t[0:n], obstacles[0:mask], send_buff_up[0:count], send_buff_dn[0:count], \
+                      recv_buff_up[0:count], recv_buff_dn[0:count], \
+                      row_u[0:params.local_ny + 2], tot_u_dev[0:batch])
+
+  return EXIT_SUCCESS;
+}
+
+int timestep_offload(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                     int up, int dn, t_pop* send_buff_up, t_pop* send_buff_dn,
+                     t_pop* recv_buff_up, t_pop* recv_buff_dn, float* row_u,
+                     t_timers* timers)
+{
+  MPI_Request requests[4]; /* halo messages in flight */
+  t_pop* c = GRIDBLOCK(cells);
+  const int plane = GRIDPLANE(cells);
+  const int row   = params.local_nx + 2;             /* cells per halo row */
+  const int count = 3 * row;                   /* floats per halo message, see halo_start() */
+  const int last  = params.local_ny * params.pitch;
+
+  accelerate_flow_offload(params, cells, obstacles);
+  fill_ghost_columns_offload(params, cells);
+  timer_lap(timers, PHASE_ACCELERATE);
+
+  /* pack the crossing densities of the first and last slab rows, ghost columns
+  ** included, as halo_start() does */
+  #pragma omp target teams distribute parallel for firstprivate(params)
+  for (int ii = -1; ii <= params.local_nx; ii++)
+  {
+    send_buff_up[ii + 1]           = DSPEED(c, plane, ii + params.pitch, 4);
+    send_buff_up[ii + 1 + row]     = DSPEED(c, plane, ii + params.pitch, 7);
+    send_buff_up[ii + 1 + 2 * row] = DSPEED(c, plane, ii + params.pitch, 8);
+    send_buff_dn[ii + 1]           = DSPEED(c, plane, ii + last, 2);
+    send_buff_dn[ii + 1 + row]     = DSPEED(c, plane, ii + last, 5);
+    send_buff_dn[ii + 1 + 2 * row] = DSPEED(c, plane, ii + last, 6);
+  }
+
+  /* interior rows 2..local_ny-1 carry on on the device during the exchange */
+  collision_offload(params, cells, tmp_cells, obstacles, 2, params.local_ny - 1, row_u);
+  timer_lap(timers, PHASE_HALO);
+
+  #ifdef OFFLOAD_HOST_MPI
+  /* MPI without device support: stage the buffers through the host */
+  #pragma omp target update from(send_buff_up[0:count], send_buff_dn[0:count])
+  MPI_Irecv(recv_buff_dn, count, MPI_POP, dn, 0, params.comm, &requests[0]);
+  MPI_Irecv(recv_buff_up, count, MPI_POP, up, 1, params.comm, &requests[1]);
+  MPI_Isend(send_buff_up, count, MPI_POP, up, 0, params.comm, &requests[2]);
+  MPI_Isend(send_buff_dn, count, MPI_POP, dn, 1, params.comm, &requests[3]);
+  MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+  #pragma omp target update to(recv_buff_up[0:count], recv_buff_dn[0:count])
+  #else
+  /* GPU-aware MPI: hand it the device copies of the buffers */
+  #pragma omp target data use_device_ptr(send_buff_up, send_buff_dn, recv_buff_up, recv_buff_dn)
+  {
+    MPI_Irecv(recv_buff_dn, count, MPI_POP, dn, 0, params.comm, &requests[0]);
+    MPI_Irecv(recv_buff_up, count, MPI_POP, up, 1, params.comm, &requests[1]);
+    MPI_Isend(send_buff_up, count, MPI_POP, up, 0, params.comm, &requests[2]);
+    MPI_Isend(send_buff_dn, count, MPI_POP, dn, 1, params.comm, &requests[3]);
+    MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+  }
+  #endif
+  timer_lap(timers, PHASE_HALO);
+  #pragma omp taskwait
+  timer_lap(timers, PHASE_COLLIDE);
+
+  /* unpack into the halo rows, as halo_finish() does */
+  #pragma omp target teams distribute parallel for firstprivate(params)
+  for (int ii = -1; ii <= params.local_nx; ii++)
+  {
+    DSPEED(c, plane, ii + last + params.pitch, 4) = recv_buff_dn[ii + 1];
+    DSPEED(c, plane, ii + last + params.pitch, 7) = recv_buff_dn[ii + 1 + row];
+    DSPEED(c, plane, ii + last + params.pitch, 8) = recv_buff_dn[ii + 1 + 2 * row];
+    DSPEED(c, plane, ii, 2)                       = recv_buff_up[ii + 1];
+    DSPEED(c, plane, ii, 5)                       = recv_buff_up[ii + 1 + row];
+    DSPEED(c, plane, ii, 6)                       = recv_buff_up[ii + 1 + 2 * row];
+  }
+
+  /* edge rows need the halos (a one-row slab is its own top and bottom) */
+  collision_offload(params, cells, tmp_cells, obstacles, 1, 1, row_u);
+  if (params.local_ny > 1) collision_offload(params, cells, tmp_cells, obstacles, params.local_ny, params.local_ny, row_u);
+  #pragma omp taskwait
+  timer_lap(timers, PHASE_COLLIDE);
+
+  return EXIT_SUCCESS;
+}
+
+int accelerate_flow_offload(const t_param params, t_speed* cells, uint8_t* obstacles)
+{
+  /* same rows and update as accelerate_flow(), one target region per run of consecutive rows */
+  t_pop* c = GRIDBLOCK(cells);
+  const int plane = GRIDPLANE(cells);
+  const float w1 = params.density * params.accel / 9.f;
+  const float w2 = params.density * params.accel / 36.f;
+
+  if (params.accel_local == 0) return EXIT_SUCCESS;
+
+  for (int j0 = 1; j0 <= params.local_ny; j0++)
+  {
+    int j1 = j0; /* the run is rows j0..j1 */
+
+    if (!params.accel_rows[j0]) continue;
+
+    while (j1 < params.local_ny && params.accel_rows[j1 + 1]) j1++;
+
+    #pragma omp target teams distribute parallel for collapse(2) firstprivate(params)
+    for (int jj = j0; jj <= j1; jj++)
+    {
+      for (int ii = 0; ii < params.local_nx; ii++)
+      {
+        const int idx = ii + jj*params.pitch;
+
+        if (!obstacles[idx]
+            && (DSPEED(c, plane, idx, 3) - w1) > 0.f
+            && (DSPEED(c, plane, idx, 6) - w2) > 0.f
+            && (DSPEED(c, plane, idx, 7) - w2) > 0.f)
+        {
+          /* increase 'east-side' densities */
+          DSPEED(c, plane, idx, 1) += w1;
+          DSPEED(c, plane, idx, 5) += w2;
+          DSPEED(c, plane, idx, 8) += w2;
+          /* decrease 'west-side' densities */
+          DSPEED(c, plane, idx, 3) -= w1;
+          DSPEED(c, plane, idx, 6) -= w2;
+          DSPEED(c, plane, idx, 7) -= w2;
+        }
+      }
+    }
+
+    j0 = j1;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int fill_ghost_columns_offload(const t_param params, t_speed* cells)
+{
+  t_pop* c = GRIDBLOCK(cells);
+  const int plane = GRIDPLANE(cells);
+
+  #pragma omp target teams distribute parallel for collapse(2) firstprivate(params)
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      DSPEED(c, plane, -1 + jj*params.pitch, kk)        = DSPEED(c, plane, params.local_nx - 1 + jj*params.pitch, kk);
+      DSPEED(c, plane, params.local_nx + jj*params.pitch, kk) = DSPEED(c, plane, jj*params.pitch, kk);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int collision_offload(const t_param params, t_speed* cells, t_speed* tmp_cells, uint8_t* obstacles,
+                      int jj_start, int jj_end, float* row_u)
+{
+  t_pop* c = GRIDBLOCK(cells);
+  t_pop* t = GRIDBLOCK(tmp_cells);
+  const int plane = GRIDPLANE(cells);
+  const int pitch = params.pitch;
+
+  /*
+  ** a team per row, one device thread per cell: no obstacle list here,
+  ** the mask picks between the mirrored pull of rebound_row() and
+  ** collision_cell(), and the fluid cells' |u| are summed into row_u[jj]
+  ** - params is a struct, which would otherwise be mapped by reference,
+  **   and this task can outlive the call
+  */
+  #pragma omp target teams distribute firstprivate(params) nowait
+  for (int jj = jj_start; jj <= jj_end; jj++)
+  {
+    float tot_u = 0.f;
+
+    #pragma omp parallel for reduction(+:tot_u)
+    for (int ii = 0; ii < params.local_nx; ii++)
+    {
+      const int idx = ii + jj*pitch;
+      float speeds[NSPEEDS];
+
+      if (obstacles[idx])
+      {
+        /* rebound: pull the densities and mirror them */
+        speeds[0] = DSPEED(c, plane, idx, 0);
+        speeds[1] = DSPEED(c, plane, idx + 1, 3);
+        speeds[2] = DSPEED(c, plane, idx + pitch, 4);
+        speeds[3] = DSPEED(c, plane, idx - 1, 1);
+        speeds[4] = DSPEED(c, plane, idx - pitch, 2);
+        speeds[5] = DSPEED(c, plane, idx + 1 + pitch, 7);
+        speeds[6] = DSPEED(c, plane, idx - 1 + pitch, 8);
+        speeds[7] = DSPEED(c, plane, idx - 1 - pitch, 5);
+        speeds[8] = DSPEED(c, plane, idx + 1 - pitch, 6);
+      }
+      else
+      {
+        /* propagate and relax */
+        speeds[0] = DSPEED(c, plane, idx, 0);
+        speeds[1] = DSPEED(c, plane, idx - 1, 1);
+        speeds[2] = DSPEED(c, plane, idx - pitch, 2);
+        speeds[3] = DSPEED(c, plane, idx + 1, 3);
+        speeds[4] = DSPEED(c, plane, idx + pitch, 4);
+        speeds[5] = DSPEED(c, plane, idx - 1 - pitch, 5);
+        speeds[6] = DSPEED(c, plane, idx + 1 - pitch, 6);
+        speeds[7] = DSPEED(c, plane, idx + 1 + pitch, 7);
+        speeds[8] = DSPEED(c, plane, idx - 1 + pitch, 8);
+        tot_u += relax_speeds(params, speeds);
+      }
+
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        DSPEED(t, plane, idx, kk) = speeds[kk];
+      }
+    }
+
+    row_u[jj] = tot_u;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int av_velocity_offload(const t_param params, float* row_u, float* tot_u_dev, const int slot)
+{
+  /* one sum over the rows, so the order (and the result) does not
+  ** depend on the no. of teams; it stays on the device until main()
+  ** copies back a batch */
+  #pragma omp target firstprivate(params)
+  {
+    float tot_u = 0.f;
+
+    for (int jj = 1; jj <= params.local_ny; jj++)
+    {
+      tot_u += row_u[jj];
+    }
+
+    tot_u_dev[slot] = tot_u;
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int av_batch_push_offload(t_av_batch* av, float* av_vels, float* tot_u_dev, int* slot)
+{
+  #pragma omp target update from(tot_u_dev[0:*slot])
+
+  for (int ss = 0; ss < *slot; ss++)
+  {
+    av_batch_push(av, av_vels, tot_u_dev[ss]);
+  }
+
+  *slot = 0;
+
+  return EXIT_SUCCESS;
+}
+
+int offload_update_host(const t_param params, t_speed* cells)
+{
+  t_pop* c = GRIDBLOCK(cells);
+  const int n = NSPEEDS * GRIDPLANE(cells);
+
+  (void)params; (void)c; /* c is only referenced by the map clause */
+
+  #pragma omp target update from(c[0:n])
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+/*
+** instantiate the SIMD kernels, one per instruction set:
+** each is compiled for its own target, so a single binary carries them
+** all and select_collision() picks one for the host at run time
+*/
+#ifdef SIMD
+#if defined(__x86_64__)
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#define SIMD_NAME         collision_avx2
+#define SIMD_WIDTH        8
+#define VF                __m256
+#define VSET1(x)          _mm256_set1_ps(x)
+#define VLOADU(p)         _mm256_loadu_ps(p)
+#define VSTOREU(p, v)     _mm256_storeu_ps(p, v)
+#define VADD(a, b)        _mm256_add_ps(a, b)
+#define VSUB(a, b)        _mm256_sub_ps(a, b)
+#define VMUL(a, b)        _mm256_mul_ps(a, b)
+#define VDIV(a, b)        _mm256_div_ps(a, b)
+#define VSQRT(a)          _mm256_sqrt_ps(a)
+#define VFLUID(p)         _mm256_sub_ps(_mm256_set1_ps(1.f), \
+                            _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(p)))))
+#include "d2q9-bgk_simd.h"
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f")
+#define SIMD_NAME         collision_avx512
+#define SIMD_WIDTH        16
+#define VF                __m512
+#define VSET1(x)          _mm512_set1_ps(x)
+#define VLOADU(p)         _mm512_loadu_ps(p)
+#define VSTOREU(p, v)     _mm512_storeu_ps(p, v)
+#define VADD(a, b)        _mm512_add_ps(a, b)
+#define VSUB(a, b)        _mm512_sub_ps(a, b)
+#define VMUL(a, b)        _mm512_mul_ps(a, b)
+#define VDIV(a, b)        _mm512_div_ps(a, b)
+#define VSQRT(a)          _mm512_sqrt_ps(a)
+#define VFLUID(p)         _mm512_sub_ps(_mm512_set1_ps(1.f), \
+                            _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128((const __m128i*)(p)))))
+#include "d2q9-bgk_simd.h"
+#pragma GCC pop_options
+#elif defined(__aarch64__)
+/* NEON is part of the base aarch64 instruction set, no target switch needed */
+#define SIMD_NAME         collision_neon
+#define SIMD_WIDTH        4
+#define VF                float32x4_t
+#define VSET1(x)          vdupq_n_f32(x)
+#define VLOADU(p)         vld1q_f32(p)
+#define VSTOREU(p, v)     vst1q_f32(p, v)
+#define VADD(a, b)        vaddq_f32(a, b)
+#define VSUB(a, b)        vsubq_f32(a, b)
+#define VMUL(a, b)        vmulq_f32(a, b)
+#define VDIV(a, b)        vdivq_f32(a, b)
+#define VSQRT(a)          vsqrtq_f32(a)
+/* loads 8 mask bytes for 4 lanes: the rows are padded to the pitch, so it stays in the mask */
+#define VFLUID(p)         vsubq_f32(vdupq_n_f32(1.f), \
+                            vcvtq_f32_u32(vmovl_u16(vget_low_u16(vmovl_u8(vld1_u8(p))))))
+#include "d2q9-bgk_simd.h"
+#endif
+#endif
+
+t_collision select_collision(const t_param params, const char* isa, const int specialise,
+                             const char** name)
+{
+  char message[1024];             /* message buffer */
+  static char full_name[128];     /* name with the shape, if specialised */
+  const int is_auto = (strcmp(isa, "auto") == 0);
+  t_collision generic = NULL;     /* kernel for any shape */
+  const t_shape_kernel* shapes = NULL; /* the same kernel for the fixed shapes */
+
+  #ifdef SIMD
+  #if defined(__x86_64__)
+  __builtin_cpu_init();
+
+  if ((is_auto || strcmp(isa, "avx512") == 0) && __builtin_cpu_supports("avx512f"))
+  {
+    *name   = "avx512";
+    generic = collision_avx512;
+    shapes  = collision_avx512_shapes;
+  }
+  else if ((is_auto || strcmp(isa, "avx2") == 0) && __builtin_cpu_supports("avx2"))
+  {
+    *name   = "avx2";
+    generic = collision_avx2;
+    shapes  = collision_avx2_shapes;
+  }
+  #elif defined(__aarch64__)
+  if (is_auto || strcmp(isa, "neon") == 0)
+  {
+    *name   = "neon";
+    generic = collision_neon;
+    shapes  = collision_neon_shapes;
+  }
+  #endif
+  #endif
+
+  if (generic == NULL && (is_auto || strcmp(isa, "scalar") == 0))
+  {
+    #ifdef AA
+    /* the AA kernels are not specialised */
+    *name = "scalar, AA pattern";
+    return collision_aa_even;
+    #else
+    *name   = "scalar";
+    generic = collision;
+    shapes  = collision_shapes;
+    #endif
+  }
+
+  if (generic == NULL)
+  {
+    sprintf(message, "collision kernel not available in this build or on this host: %s", isa);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (!specialise) return generic;
+
+  t_collision kernel = find_shape_kernel(params, shapes, generic);
+
+  if (kernel != generic)
+  {
+    snprintf(full_name, sizeof(full_name), "%s, specialised for nx = %d, omega = %g",
+             *name, params.local_nx, params.omega);
+    *name = full_name;
+  }
+
+  return kernel;
+}
+
+t_collision find_shape_kernel(const t_param params, const t_shape_kernel* shapes,
+                              t_collision generic)
+{
+  for (int ss = 0; shapes[ss].kernel != NULL; ss++)
+  {
+    /* omega is read with %f, so it compares equal to the same literal as a float */
+    if (shapes[ss].nx == params.local_nx && shapes[ss].omega == params.omega) return shapes[ss].kernel;
+  }
+
+  return generic;
+}
+
+float av_velocity(const t_param params, t_speed* cells, uint8_t* obstacles)
+{
+  float local_tot_u;   /* this rank's tot_u */
+  float global_tot_u;  /* tot_u summed over all ranks */
+
+  av_velocity_partial(params, cells, obstacles, &local_tot_u);
+
+  /* every rank needs the result for calc_reynolds(), so all-reduce */
+  MPI_Allreduce(&local_tot_u, &global_tot_u, 1, MPI_FLOAT, MPI_SUM, params.comm);
+
+  return global_tot_u / (float)params.fluid_cells;
+}
+
+int av_velocity_partial(const t_param params, t_speed* cells, uint8_t* obstacles,
+                        float* tot_u_ptr)
+{
+  float tot_u;          /* accumulated magnitudes of velocity for each cell */
+
+  /* initialise */
+  tot_u = 0.f;
+
+  /* loop over all rows in the slab */
+  #pragma omp parallel for schedule(static) reduction(+:tot_u)
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    tot_u += av_velocity_row(params, cells, obstacles, jj);
+  }
+
+  *tot_u_ptr = tot_u;
+
+  return EXIT_SUCCESS;
+}
+
+static inline float av_velocity_row(const t_param params, t_speed* cells, uint8_t* obstacles,
+                                    const int jj)
+{
+  float tot_u = 0.f;    /* accumulated magnitudes of velocity for each cell */
+
+  /* blocked cells contribute zero: no branch per cell, and the
+  ** no. of cells (params.fluid_cells) is fixed */
+  for (int ii = 0; ii < params.local_nx; ii++)
+  {
+    /* this cell's densities, and their total */
+    float speeds[NSPEEDS];
+    float local_density = 0.f;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      speeds[kk] = POP_GET(params, STATE(cells, params, ii, jj, kk), kk);
+      local_density += speeds[kk];
+    }
+
+    /* x-component of velocity */
+    float u_x = (speeds[1]
+                  + speeds[5]
+                  + speeds[8]
+                  - (speeds[3]
+                     + speeds[6]
+                     + speeds[7]))
+                 / local_density;
+    /* compute y velocity component */
+    float u_y = (speeds[2]
+                  + speeds[5]
+                  + speeds[6]
+                  - (speeds[4]
+                     + speeds[7]
+                     + speeds[8]))
+                 / local_density;
+    /* accumulate the norm of x- and y- velocity components */
+    tot_u += (float)(1 - obstacles[ii + jj*params.pitch]) * sqrtf((u_x * u_x) + (u_y * u_y));
+  }
+
+  return tot_u;
+}
+
+int av_batch_init(t_av_batch* av, const int batch, const int fluid_cells, const int first,
+                  const int ring, t_av_stream* stream, const MPI_Comm comm)
+{
+  av->batch         = batch;
+  av->comm          = comm;
+  av->ring          = ring;
+  av->stream        = stream;
+  av->fluid_cells   = (float)fluid_cells;
+  av->half          = 0;
+  av->filled        = 0;
+  av->first         = first;
+  av->pending       = 0;
+  av->pending_first = first;
+  av->done          = first;
+  av->request       = MPI_REQUEST_NULL;
+
+  av->partial = (float*)malloc(sizeof(float) * 2 * batch);
+  av->total   = (float*)malloc(sizeof(float) * 2 * batch);
+
+  if (av->partial == NULL || av->total == NULL) die("cannot allocate memory for av_vels batches", __LINE__, __FILE__);
+
+  return EXIT_SUCCESS;
+}
+
+int av_batch_push(t_av_batch* av, float* av_vels, const float tot_u)
+{
+  float* partial = av->partial + av->half * av->batch;
+
+  partial[av->filled] = tot_u;
+  av->filled++;
+
+  if (av->filled == av->batch) av_batch_post(av, av_vels);
+
+  return EXIT_SUCCESS;
+}
+
+int av_batch_completes(const t_av_batch* av)
+{
+  /* a full half is posted, which first waits for the one in flight */
+  return av->filled + 1 == av->batch && av->pending > 0;
+}
+
+int av_batch_post(t_av_batch* av, float* av_vels)
+{
+  const int offset = av->half * av->batch; /* start of the half being posted */
+
+  if (av->filled == 0) return EXIT_SUCCESS;
+
+  /* the other half is filled next, so its reduction must be complete */
+  av_batch_wait(av, av_vels);
+
+  MPI_Iallreduce(av->partial + offset, av->total + offset, av->filled,
+                 MPI_FLOAT, MPI_SUM, av->comm, &av->request);
+
+  av->pending       = av->filled;
+  av->pending_first = av->first;
+  av->first        += av->filled;
+  av->filled        = 0;
+  av->half          = 1 - av->half;
+
+  return EXIT_SUCCESS;
+}
+
+int av_batch_wait(t_av_batch* av, float* av_vels)
+{
+  /* the reduction in flight belongs to the half not being filled */
+  const float* total = av->total + (1 - av->half) * av->batch;
+
+  if (av->pending == 0) return EXIT_SUCCESS;
+
+  MPI_Wait(&av->request, MPI_STATUS_IGNORE);
+
+  /* the entries these overwrite must have reached the file */
+  if (av->stream != NULL) av_stream_reserve(av->stream, av->pending_first + av->pending);
+
+  for (int tt = 0; tt < av->pending; tt++)
+  {
+    av_vels[(av->pending_first + tt) % av->ring] = total[tt] / av->fluid_cells;
+  }
+
+  av->done    = av->pending_first + av->pending;
+  av->pending = 0;
+
+  if (av->stream != NULL) av_stream_publish(av->stream, av->done);
+
+  return EXIT_SUCCESS;
+}
+
+int av_batch_flush(t_av_batch* av, float* av_vels)
+{
+  av_batch_post(av, av_vels);
+  av_batch_wait(av, av_vels);
+
+  return EXIT_SUCCESS;
+}
+
+int av_batch_free(t_av_batch* av)
+{
+  free(av->partial);
+  av->partial = NULL;
+
+  free(av->total);
+  av->total = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+int av_stream_open(t_av_stream* stream, const char* path, const float* ring, const int size)
+{
+  stream->ring    = ring;
+  stream->size    = size;
+  stream->done    = 0;
+  stream->written = 0;
+  stream->stop    = 0;
+  stream->fp      = fopen(path, "w");
+
+  if (stream->fp == NULL) die("could not open file output file", __LINE__, __FILE__);
+
+  /* so each block goes out in a few large writes */
+  setvbuf(stream->fp, NULL, _IOFBF, 1 << 20);
+
+  pthread_mutex_init(&stream->lock, NULL);
+  pthread_cond_init(&stream->cond, NULL);
+
+  if (pthread_create(&stream->thread, NULL, av_stream_writer, stream) != 0)
+  {
+    die("could not start the av_vels writer thread", __LINE__, __FILE__);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int av_stream_publish(t_av_stream* stream, const int done)
+{
+  pthread_mutex_lock(&stream->lock);
+  stream->done = done;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+
+  return EXIT_SUCCESS;
+}
+
+int av_stream_reserve(t_av_stream* stream, const int end)
+{
+  pthread_mutex_lock(&stream->lock);
+
+  while (stream->written < end - stream->size)
+  {
+    pthread_cond_wait(&stream->cond, &stream->lock);
+  }
+
+  pthread_mutex_unlock(&stream->lock);
+
+  return EXIT_SUCCESS;
+}
+
+int av_stream_sync(t_av_stream* stream)
+{
+  pthread_mutex_lock(&stream->lock);
+
+  while (stream->written < stream->done)
+  {
+    pthread_cond_wait(&stream->cond, &stream->lock);
+  }
+
+  pthread_mutex_unlock(&stream->lock);
+
+  return EXIT_SUCCESS;
+}
+
+int av_stream_close(t_av_stream* stream)
+{
+  pthread_mutex_lock(&stream->lock);
+  stream->stop = 1;
+  pthread_cond_broadcast(&stream->cond);
+  pthread_mutex_unlock(&stream->lock);
+
+  pthread_join(stream->thread, NULL);
+  pthread_cond_destroy(&stream->cond);
+  pthread_mutex_destroy(&stream->lock);
+
+  fclose(stream->fp);
+  stream->fp = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+void* av_stream_writer(void* arg)
+{
+  t_av_stream* stream = (t_av_stream*)arg;
+
+  pthread_mutex_lock(&stream->lock);
+
+  for (;;)
+  {
+    int first, last; /* the block published since the last one */
+
+    while (stream->written == stream->done && !stream->stop)
+    {
+      pthread_cond_wait(&stream->cond, &stream->lock);
+    }
+
+    if (stream->written == stream->done) break;
+
+    first = stream->written;
+    last  = stream->done;
+
+    /* the main thread does not touch these entries until written passes them */
+    pthread_mutex_unlock(&stream->lock);
+
+    for (int tt = first; tt < last; tt++)
+    {
+      fprintf(stream->fp, "%d:\t%.12E\n", tt, stream->ring[tt % stream->size]);
+    }
+
+    if (fflush(stream->fp) != 0) die("could not write av_vels file", __LINE__, __FILE__);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->written = last;
+    pthread_cond_broadcast(&stream->cond);
+  }
+
+  pthread_mutex_unlock(&stream->lock);
+
+  return NULL;
+}
+
+int av_vels_read(const char* path, const int n, float* av)
+{
+  FILE* fp = fopen(path, "r");
+
+  if (fp == NULL) die("could not open av_vels file", __LINE__, __FILE__);
+
+  for (int tt = 0; tt < n; tt++)
+  {
+    if (fscanf(fp, "%*d: %e", &av[tt]) != 1) die("av_vels file is too short", __LINE__, __FILE__);
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int av_converged(const float* av_vels, const int ring, const int done, const int window, const float tolerance)
+{
+  float lo, hi; /* range of the window */
+
+  if (done < window) return 0;
+
+  lo = hi = av_vels[(done - 1) % ring];
+
+  for (int tt = done - window; tt < done - 1; tt++)
+  {
+    if (av_vels[tt % ring] < lo) lo = av_vels[tt % ring];
+    if (av_vels[tt % ring] > hi) hi = av_vels[tt % ring];
+  }
+
+  return (hi - lo) < tolerance * fabsf(av_vels[(done - 1) % ring]);
+}
+
+float total_density(const t_param params, t_speed* cells)
+{
+  float total = 0.f;  /* accumulator */
+
+  /* local slab only */
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    for (int ii = 0; ii < params.local_nx; ii++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        total += POP_GET(params, STATE(cells, params, ii, jj, kk), kk);
+      }
+    }
+  }
+
+  return total;
+}
+
+float calc_reynolds(const t_param params, t_speed* cells, uint8_t* obstacles)
+{
+  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+
+  return av_velocity(params, cells, obstacles) * params.reynolds_dim / viscosity;
+}
+
+static inline void cell_state(const t_param params, t_speed* cells, uint8_t* obstacles,
+                              const int ii, const int jj, t_state_record* record)
+{
+  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
+  float local_density;         /* per grid cell sum of densities */
+  float pressure;              /* fluid pressure in grid cell */
+  float u_x;                   /* x-component of velocity in grid cell */
+  float u_y;                   /* y-component of velocity in grid cell */
+  float u;                     /* norm--root of summed squares--of u_x and u_y */
+
+  /* an occupied cell */
+  if (obstacles[ii + jj*params.pitch])
+  {
+    u_x = u_y = u = 0.f;
+    pressure = params.density * c_sq;
+  }
+  /* no obstacle */
+  else
+  {
+    float speeds[NSPEEDS];  /* this cell's densities */
+    local_density = 0.f;
+
+    for (int kk = 0; kk < NSPEEDS; kk++)
+    {
+      speeds[kk] = POP_GET(params, STATE(cells, params, ii, jj, kk), kk);
+      local_density += speeds[kk];
+    }
+
+    /* compute x velocity component */
+    u_x = (speeds[1]
+           + speeds[5]
+           + speeds[8]
+           - (speeds[3]
+              + speeds[6]
+              + speeds[7]))
+          / local_density;
+    /* compute y velocity component */
+    u_y = (speeds[2]
+           + speeds[5]
+           + speeds[6]
+           - (speeds[4]
+              + speeds[7]
+              + speeds[8]))
+          / local_density;
+    /* compute norm of velocity */
+    u = sqrtf((u_x * u_x) + (u_y * u_y));
+    /* compute pressure */
+    pressure = local_density * c_sq;
+  }
+
+  record->u_x      = u_x;
+  record->u_y      = u_y;
+  record->u        = u;
+  record->pressure = pressure;
+  record->obstacle = obstacles[ii + jj*params.pitch];
+}
+
+int write_values(const t_param params, t_speed* cells, uint8_t* obstacles, float* av_vels,
+                 const int rank, const int binary)
+{
+  FILE* fp;                     /* file pointer */
+  MPI_File fh;                  /* final state file, shared by all ranks */
+  MPI_Comm row_comm, col_comm;  /* the blocks of this one's process row / process column */
+  MPI_Datatype file_type;       /* where this block's rows go in the file */
+  MPI_Offset* row_bytes;        /* bytes of each of this block's rows, then of the whole rows */
+  MPI_Offset* before;           /* bytes of the blocks west of this one in each row */
+  MPI_Offset slab_bytes = 0;    /* bytes of this process row's slab */
+  MPI_Offset offset = 0;        /* where that slab starts */
+  MPI_Aint* displs;             /* file offset of each of this block's rows */
+  int* lens;                    /* and its length */
+  char* buff;                   /* this rank's block, formatted */
+  size_t used = 0;              /* bytes of buff filled */
+  size_t capacity;              /* bytes of buff allocated */
+  int sub_row[2] = { 0, 1 };    /* MPI_Cart_sub() dims kept for row_comm */
+  int sub_col[2] = { 1, 0 };    /* and for col_comm */
+
+  /*
+  ** every rank formats its own block, in the same row-major order as the
+  ** serial output, then writes each of its rows at its own offset with MPI-IO:
+  ** - text: one line per cell, lengths vary so offsets come from MPI_Exscan()s,
+  **   over the blocks west in each row, then over the slabs above
+  ** - binary: FINALSTATEMAGIC, nx, ny, then one t_state_record per cell
+  */
+  if (binary)
+  {
+    capacity = sizeof(t_state_record) * params.local_ny * params.local_nx;
+  }
+  else
+  {
+    capacity = (size_t)FINALSTATELINE * params.local_ny * params.local_nx;
+  }
+
+  buff      = (char*)malloc(capacity);
+  row_bytes = (MPI_Offset*)malloc(sizeof(MPI_Offset) * params.local_ny);
+  before    = (MPI_Offset*)calloc(params.local_ny, sizeof(MPI_Offset));
+  displs    = (MPI_Aint*)malloc(sizeof(MPI_Aint) * params.local_ny);
+  lens      = (int*)malloc(sizeof(int) * params.local_ny);
+
+  if (buff == NULL || row_bytes == NULL || before == NULL || displs == NULL || lens == NULL)
+  {
+    die("cannot allocate memory for final state output", __LINE__, __FILE__);
+  }
+
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    const size_t row_start = used;
+
+    for (int ii = 0; ii < params.local_nx; ii++)
+    {
+      t_state_record record;
+
+      cell_state(params, cells, obstacles, ii, jj, &record);
+
+      /* append to this rank's block */
+      if (binary)
+      {
+        memcpy(buff + used, &record, sizeof(record));
+        used += sizeof(record);
+      }
+      else
+      {
+        used += sprintf(buff + used, "%d %d %.12E %.12E %.12E %.12E %d\n",
+                        params.col_offset + ii, params.row_offset + jj - 1,
+                        record.u_x, record.u_y, record.u, record.pressure, record.obstacle);
+      }
+    }
+
+    lens[jj - 1]      = (int)(used - row_start);
+    row_bytes[jj - 1] = lens[jj - 1];
+  }
+
+  if (used > (size_t)INT_MAX) die("final state block too large for a single MPI-IO write", __LINE__, __FILE__);
+
+  /* within a row, this block starts after the blocks west of it (MPI_Exscan() leaves
+  ** the first one's result undefined), and the whole row is the sum over the process row */
+  MPI_Cart_sub(params.comm, sub_row, &row_comm);
+  MPI_Cart_sub(params.comm, sub_col, &col_comm);
+  MPI_Exscan(row_bytes, before, params.local_ny, MPI_OFFSET, MPI_SUM, row_comm);
+  if (params.proc_col == 0) memset(before, 0, sizeof(MPI_Offset) * params.local_ny);
+  MPI_Allreduce(MPI_IN_PLACE, row_bytes, params.local_ny, MPI_OFFSET, MPI_SUM, row_comm);
+
+  /* slabs are in process row order, so this one starts after the bytes of all those above */
+  for (int jj = 0; jj < params.local_ny; jj++)
+  {
+    slab_bytes += row_bytes[jj];
+  }
+
+  MPI_Exscan(&slab_bytes, &offset, 1, MPI_OFFSET, MPI_SUM, col_comm);
+  if (params.proc_row == 0) offset = 0;
+  if (binary) offset += FINALSTATEHEADER;
+
+  for (int jj = 0; jj < params.local_ny; jj++)
+  {
+    displs[jj] = (MPI_Aint)(offset + before[jj]);
+    offset += row_bytes[jj];
+  }
+
+  MPI_Type_create_hindexed(params.local_ny, lens, displs, MPI_CHAR, &file_type);
+  MPI_Type_commit(&file_type);
+  MPI_Comm_free(&row_comm);
+  MPI_Comm_free(&col_comm);
+
+  if (MPI_File_open(params.comm, params.final_state_file, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  /* truncate anything left over from a longer previous run */
+  MPI_File_set_size(fh, 0);
+
+  if (binary && rank == MASTER)
+  {
+    int dims[2] = { params.nx, params.ny };
+    MPI_File_write_at(fh, 0, FINALSTATEMAGIC, FINALSTATEMAGICLEN, MPI_CHAR, MPI_STATUS_IGNORE);
+    MPI_File_write_at(fh, 8, dims, 2, MPI_INT, MPI_STATUS_IGNORE);
+  }
+
+  /* the view makes the block's rows one collective write */
+  MPI_File_set_view(fh, 0, MPI_CHAR, file_type, "native", MPI_INFO_NULL);
+
+  if (MPI_File_write_all(fh, buff, (int)used, MPI_CHAR, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+  {
+    die("could not write final state", __LINE__, __FILE__);
+  }
+
+  MPI_Type_free(&file_type);
+  free(row_bytes);
+  free(before);
+  free(displs);
+  free(lens);
+  MPI_File_close(&fh);
+  free(buff);
+
+  /* the av_vels series is the same on every rank, MASTER writes it (unless it was streamed) */
+  if (rank != MASTER || av_vels == NULL) return EXIT_SUCCESS;
+
+  fp = fopen(params.av_vels_file, "w");
+
+  if (fp == NULL)
+  {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int ii = 0; ii < params.maxIters; ii++)
+  {
+    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+  }
+
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int check_values(const t_param params, t_speed* cells, uint8_t* obstacles, float* av_vels,
+                 const char* ref_av_vels, const char* ref_final_state, const double tolerance,
+                 const int rank)
+{
+  int failed = 0;  /* either check failed (MASTER until the end) */
+
+  /* av_vels: MASTER streams the reference series, as d2q9-check does */
+  if (ref_av_vels != NULL && rank == MASTER)
+  {
+    FILE*  fp;                      /* file pointer */
+    double ref;                     /* one timestep of the reference */
+    double total = 0.0;             /* sum of |ref - sim| */
+    double best_pcnt = 0.0, best_diff = 0.0, best_sim = 0.0, best_ref = 0.0;
+    int    best_step = 0;
+    int    steps = 0;               /* no. of reference timesteps */
+
+    fp = fopen(ref_av_vels, "r");
+
+    if (fp == NULL)
+    {
+      char message[1024];
+
+      sprintf(message, "could not open reference av_vels file: %s", ref_av_vels);
+      die(message, __LINE__, __FILE__);
+    }
+
+    while (fscanf(fp, "%*d: %lf", &ref) == 1)
+    {
+      if (steps < params.maxIters)
+      {
+        const double sim  = av_vels[steps];
+        const double diff = ref - sim;
+        const double pcnt = 100.0 * (diff / (ref - diff));
+
+        /* the first value that is not finite counts as the largest, as in check.py */
+        if (steps == 0 || (isfinite(best_pcnt) && !(fabs(pcnt) <= fabs(best_pcnt))))
+        {
+          best_step = steps;
+          best_pcnt = pcnt;
+          best_diff = diff;
+          best_sim  = sim;
+          best_ref  = ref;
+        }
+
+        total += fabs(diff);
+      }
+
+      steps++;
+    }
+
+    fclose(fp);
+
+    if (steps != params.maxIters)
+    {
+      printf("Different number of steps in av_vels files\n");
+      failed = 1;
+    }
+    else
+    {
+      printf("Total difference in av_vels : %.12E\n", total);
+      printf("Biggest difference (at step %d) : %.12E\n", best_step, best_diff);
+      printf("  %.12E vs. %.12E = %.2g%%\n\n", best_sim, best_ref, best_pcnt);
+
+      if (!isfinite(best_pcnt) || fabs(best_pcnt) > tolerance)
+      {
+        printf("av_vels failed check\n");
+        failed = 1;
+      }
+    }
+  }
+
+  /* final state: every rank compares its own block with the same cells of a binary reference */
+  if (ref_final_state != NULL)
+  {
+    MPI_File fh;                                      /* reference file, shared by all ranks */
+    char     magic[FINALSTATEMAGICLEN];
+    int      dims[2];                                 /* nx, ny from its header */
+    const long cells_here = (long)params.local_ny * params.local_nx;
+    int      sizes[2]    = { params.ny, params.nx };             /* the file's records */
+    int      subsizes[2] = { params.local_ny, params.local_nx }; /* this rank's block of them */
+    int      starts[2]   = { params.row_offset, params.col_offset };
+    MPI_Datatype record_type, block_type;
+    t_state_record* ref = (t_state_record*)malloc(sizeof(t_state_record) * cells_here);
+    double   total = 0.0;                             /* this rank's sum of |ref - sim| */
+    double   all_total;                               /* all ranks' */
+    double   best[6] = { 0.0 };                       /* ii, jj, diff, pcnt, sim, ref of the largest */
+    struct { double score; int rank; } local, global; /* which rank has the largest */
+
+    if (ref == NULL) die("cannot allocate memory for reference final state", __LINE__, __FILE__);
+
+    if (sizeof(t_state_record) * cells_here > (size_t)INT_MAX)
+    {
+      die("final state slab too large for a single MPI-IO read", __LINE__, __FILE__);
+    }
+
+    if (MPI_File_open(params.comm, ref_final_state, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+    {
+      char message[1024];
+
+      sprintf(message, "could not open reference final state file: %s", ref_final_state);
+      die(message, __LINE__, __FILE__);
+    }
+
+    if (MPI_File_read_at_all(fh, 0, magic, FINALSTATEMAGICLEN, MPI_CHAR, MPI_STATUS_IGNORE) != MPI_SUCCESS
+        || MPI_File_read_at_all(fh, FINALSTATEMAGICLEN, dims, 2, MPI_INT, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+    {
+      die("could not read reference final state", __LINE__, __FILE__);
+    }
+
+    if (memcmp(magic, FINALSTATEMAGIC, FINALSTATEMAGICLEN) != 0)
+    {
+      die("reference final state must be binary, convert it with d2q9-check --convert", __LINE__, __FILE__);
+    }
+
+    if (dims[0] != params.nx || dims[1] != params.ny)
+    {
+      die("reference final state has different grid dimensions", __LINE__, __FILE__);
+    }
+
+    /* this rank's block of the nx x ny records after the header */
+    MPI_Type_contiguous(sizeof(t_state_record), MPI_BYTE, &record_type);
+    MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, record_type, &block_type);
+    MPI_Type_commit(&record_type);
+    MPI_Type_commit(&block_type);
+    MPI_File_set_view(fh, FINALSTATEHEADER, record_type, block_type, "native", MPI_INFO_NULL);
+
+    if (MPI_File_read_all(fh, ref, (int)cells_here, record_type, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+    {
+      die("could not read reference final state", __LINE__, __FILE__);
+    }
+
+    MPI_File_close(&fh);
+    MPI_Type_free(&block_type);
+    MPI_Type_free(&record_type);
+
+    /* same row-major order and tie breaking as the serial check */
+    for (int jj = 1; jj <= params.local_ny; jj++)
+    {
+      for (int ii = 0; ii < params.local_nx; ii++)
+      {
+        t_state_record record;
+        const t_state_record* r = &ref[ii + (long)(jj - 1) * params.local_nx];
+
+        cell_state(params, cells, obstacles, ii, jj, &record);
+
+        const double diff = (double)r->pressure - record.pressure;
+        const double pcnt = 100.0 * (diff / ((double)r->pressure - diff));
+
+        if ((jj == 1 && ii == 0) || (isfinite(best[3]) && !(fabs(pcnt) <= fabs(best[3]))))
+        {
+          best[0] = params.col_offset + ii;
+          best[1] = params.row_offset + jj - 1;
+          best[2] = diff;
+          best[3] = pcnt;
+          best[4] = record.pressure;
+          best[5] = r->pressure;
+        }
+
+        total += fabs(diff);
+      }
+    }
+
+    free(ref);
+
+    /* MPI_MAXLOC keeps the lowest rank on a tie, the first one in row-major order
+    ** unless --proc-grid splits the columns */
+    local.score = isfinite(best[3]) ? fabs(best[3]) : HUGE_VAL;
+    local.rank  = rank;
+    MPI_Allreduce(&local, &global, 1, MPI_DOUBLE_INT, MPI_MAXLOC, params.comm);
+    MPI_Bcast(best, 6, MPI_DOUBLE, global.rank, params.comm);
+    MPI_Reduce(&total, &all_total, 1, MPI_DOUBLE, MPI_SUM, MASTER, params.comm);
+
+    if (rank == MASTER)
+    {
+      printf("Total difference in final_state : %.12E\n", all_total);
+      printf("Biggest difference (at coord (%d,%d)) : %.12E\n", (int)best[0], (int)best[1], best[2]);
+      printf("  %.12E vs. %.12E = %.2g%%\n\n", best[4], best[5], best[3]);
+
+      if (!isfinite(best[3]) || fabs(best[3]) > tolerance)
+      {
+        printf("final state failed check\n");
+        failed = 1;
+      }
+    }
+  }
+
+  if ((ref_av_vels != NULL || ref_final_state != NULL) && rank == MASTER && !failed)
+  {
+    printf("Both tests passed!\n");
+  }
+
+  MPI_Bcast(&failed, 1, MPI_INT, MASTER, params.comm);
+
+  return failed;
+}
+
+int checkpoint_init(t_checkpoint* ckpt, const char* path, const t_param params)
+{
+  ckpt->path      = path;
+  ckpt->pending   = 0;
+  ckpt->nrequests = 0;
+  ckpt->slab      = NULL;
+  ckpt->series    = NULL;
+  ckpt->requests  = NULL;
+
+  if (path == NULL) return EXIT_SUCCESS;
+
+  if (snprintf(ckpt->tmp_path, sizeof(ckpt->tmp_path), "%s.tmp", path) >= (int)sizeof(ckpt->tmp_path))
+  {
+    die("checkpoint file name too long", __LINE__, __FILE__);
+  }
+
+  ckpt->slab     = (float*)malloc(sizeof(float) * NSPEEDS * params.local_nx * params.local_ny);
+  ckpt->requests = (MPI_Request*)malloc(sizeof(MPI_Request) * (params.local_ny + 3));
+
+  if (ckpt->slab == NULL || ckpt->requests == NULL) die("cannot allocate memory for checkpoint", __LINE__, __FILE__);
+
+  return EXIT_SUCCESS;
+}
+
+int checkpoint_start(t_checkpoint* ckpt, const t_param params, t_speed* cells, float* av_vels,
+                     t_av_stream* stream, const int iteration, const int rank)
+{
+  const int row_floats = NSPEEDS * params.nx;         /* floats per row in the file */
+  const int block_row  = NSPEEDS * params.local_nx;   /* floats per row of this rank's block */
+  const MPI_Offset offset = CHECKPOINTHEADER
+                          + (MPI_Offset)sizeof(float) * (row_floats * (MPI_Offset)params.row_offset
+                                                         + NSPEEDS * params.col_offset);
+  const MPI_Offset av_offset = CHECKPOINTHEADER + (MPI_Offset)sizeof(float) * row_floats * params.ny;
+  /* the block is contiguous in the file if it spans whole rows, else it is written row by row */
+  const int pieces = (params.local_nx == params.nx) ? 1 : params.local_ny;
+
+  /* one checkpoint in flight at a time, slab is reused */
+  checkpoint_finish(ckpt, rank);
+
+  /* the densities themselves, whatever the layout or storage precision */
+  #pragma omp parallel for schedule(static)
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    for (int ii = 0; ii < params.local_nx; ii++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        ckpt->slab[kk + ii*NSPEEDS + (jj - 1)*block_row] = POP_GET(params, STATE(cells, params, ii, jj, kk), kk);
+      }
+    }
+  }
+
+  if (MPI_File_open(params.comm, ckpt->tmp_path, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &ckpt->fh) != MPI_SUCCESS)
+  {
+    die("could not open checkpoint file", __LINE__, __FILE__);
+  }
+
+  MPI_File_set_size(ckpt->fh, 0);
+
+  /* each rank's rows are at a fixed place, so the blocks need no coordination */
+  ckpt->nrequests = 0;
+
+  for (int pp = 0; pp < pieces; pp++)
+  {
+    const int rows = params.local_ny / pieces;
+
+    MPI_File_iwrite_at(ckpt->fh, offset + (MPI_Offset)sizeof(float) * row_floats * rows * pp,
+                       ckpt->slab + (long)block_row * rows * pp, block_row * rows, MPI_FLOAT,
+                       &ckpt->requests[ckpt->nrequests++]);
+  }
+
+  if (rank == MASTER)
+  {
+    ckpt->header[0] = params.nx;
+    ckpt->header[1] = params.ny;
+    ckpt->header[2] = iteration;
+    MPI_File_iwrite_at(ckpt->fh, 0, CHECKPOINTMAGIC, 8, MPI_CHAR, &ckpt->requests[ckpt->nrequests++]);
+    MPI_File_iwrite_at(ckpt->fh, 8, ckpt->header, 3, MPI_INT, &ckpt->requests[ckpt->nrequests++]);
+
+    /* only the last av_ring entries are in memory, the rest are read back */
+    if (stream != NULL)
+    {
+      av_stream_sync(stream);
+      ckpt->series = (float*)malloc(sizeof(float) * (iteration > 0 ? iteration : 1));
+
+      if (ckpt->series == NULL) die("cannot allocate memory for checkpoint", __LINE__, __FILE__);
+
+      av_vels_read(params.av_vels_file, iteration, ckpt->series);
+      av_vels = ckpt->series;
+    }
+
+    /* entries 0..iteration-1 are not written again this run */
+    MPI_File_iwrite_at(ckpt->fh, av_offset, av_vels, iteration, MPI_FLOAT, &ckpt->requests[ckpt->nrequests++]);
+  }
+
+  ckpt->pending   = 1;
+  ckpt->finish_at = iteration + CHECKPOINTLAG;
+
+  return EXIT_SUCCESS;
+}
+
+int checkpoint_finish(t_checkpoint* ckpt, const int rank)
+{
+  if (!ckpt->pending) return EXIT_SUCCESS;
+
+  MPI_Waitall(ckpt->nrequests, ckpt->requests, MPI_STATUSES_IGNORE);
+
+  /* collective, so every slab is in the file once it returns */
+  MPI_File_close(&ckpt->fh);
+
+  if (rank == MASTER && rename(ckpt->tmp_path, ckpt->path) != 0)
+  {
+    die("could not rename checkpoint file", __LINE__, __FILE__);
+  }
+
+  free(ckpt->series);
+  ckpt->series  = NULL;
+  ckpt->pending = 0;
+
+  return EXIT_SUCCESS;
+}
+
+int checkpoint_free(t_checkpoint* ckpt)
+{
+  free(ckpt->slab);
+  free(ckpt->requests);
+  ckpt->slab     = NULL;
+  ckpt->requests = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+int restart(const char* path, const t_param params, t_speed* cells, float* av_vels,
+            t_av_stream* stream)
+{
+  MPI_File fh;                                /* the checkpoint, read by all ranks */
+  char  magic[8];                             /* CHECKPOINTMAGIC */
+  int   header[3];                            /* nx, ny, iteration */
+  float* slab;                                /* this rank's densities */
+  const int row_floats = NSPEEDS * params.nx; /* floats per row in the file */
+  const int block_row  = NSPEEDS * params.local_nx; /* floats per row of this rank's block */
+  const MPI_Offset av_offset = CHECKPOINTHEADER + (MPI_Offset)sizeof(float) * row_floats * params.ny;
+  int sizes[2]    = { params.ny, row_floats };                    /* the file's densities */
+  int subsizes[2] = { params.local_ny, block_row };               /* this rank's block of them */
+  int starts[2]   = { params.row_offset, NSPEEDS * params.col_offset };
+  MPI_Datatype block_type;
+
+  if (MPI_File_open(params.comm, path, MPI_MODE_RDONLY, MPI_INFO_NULL, &fh) != MPI_SUCCESS)
+  {
+    die("could not open checkpoint file", __LINE__, __FILE__);
+  }
+
+  MPI_File_read_at_all(fh, 0, magic, 8, MPI_CHAR, MPI_STATUS_IGNORE);
+  MPI_File_read_at_all(fh, 8, header, 3, MPI_INT, MPI_STATUS_IGNORE);
+
+  if (memcmp(magic, CHECKPOINTMAGIC, 8) != 0) die("not a checkpoint file", __LINE__, __FILE__);
+
+  if (header[0] != params.nx || header[1] != params.ny)
+  {
+    die("checkpoint grid size does not match the parameter file", __LINE__, __FILE__);
+  }
+
+  if (header[2] < 0 || header[2] > params.maxIters)
+  {
+    die("checkpoint iteration out of range for maxIters", __LINE__, __FILE__);
+  }
+
+  /* the cells of this rank's block, wherever the writer's blocks ended */
+  slab = (float*)malloc(sizeof(float) * block_row * params.local_ny);
+
+  if (slab == NULL) die("cannot allocate memory for checkpoint", __LINE__, __FILE__);
+
+  MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, MPI_FLOAT, &block_type);
+  MPI_Type_commit(&block_type);
+  MPI_File_set_view(fh, CHECKPOINTHEADER, MPI_FLOAT, block_type, "native", MPI_INFO_NULL);
+
+  if (MPI_File_read_all(fh, slab, block_row * params.local_ny, MPI_FLOAT, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+  {
+    die("could not read checkpoint file", __LINE__, __FILE__);
+  }
+
+  /* back to bytes from the start of the file for the series */
+  MPI_File_set_view(fh, 0, MPI_BYTE, MPI_BYTE, "native", MPI_INFO_NULL);
+  MPI_Type_free(&block_type);
+
+  /* the series a ring at a time, so av_vels ends up holding the latest entries */
+  for (int first = 0; first < header[2]; first += params.av_ring)
+  {
+    const int count = (header[2] - first < params.av_ring) ? header[2] - first : params.av_ring;
+
+    if (MPI_File_read_at_all(fh, av_offset + (MPI_Offset)sizeof(float) * first, av_vels, count,
+                             MPI_FLOAT, MPI_STATUS_IGNORE) != MPI_SUCCESS)
+    {
+      die("could not read checkpoint file", __LINE__, __FILE__);
+    }
+
+    if (stream != NULL)
+    {
+      av_stream_publish(stream, first + count);
+      av_stream_sync(stream);
+    }
+  }
+
+  MPI_File_close(&fh);
+
+  for (int jj = 1; jj <= params.local_ny; jj++)
+  {
+    for (int ii = 0; ii < params.local_nx; ii++)
+    {
+      for (int kk = 0; kk < NSPEEDS; kk++)
+      {
+        SPEED(cells, ii + jj*params.pitch, kk) = POP_PUT(params, slab[kk + ii*NSPEEDS + (jj - 1)*block_row], kk);
+      }
+    }
+  }
+
+  free(slab);
+
+  return header[2];
+}
+
+static inline double wtime(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+void timer_start(t_timers* timers)
+{
+  for (int pp = 0; pp < NPHASES; pp++)
+  {
+    timers->phase[pp] = 0.0;
+  }
+
+  timers->mark = wtime();
+}
+
+static inline void timer_lap(t_timers* timers, const int phase)
+{
+  const double now = wtime();
+
+  timers->phase[phase] += now - timers->mark;
+  timers->mark = now;
+}
+
+int report_timings(const t_param params, const t_timers* timers, const int iterations,
+                   const double elapsed, const char* isa_name, const char* json_path,
+                   const int rank, const int size)
+{
+  static const char* names[NPHASES] = { "accelerate", "collide", "halo", "reduce", "checkpoint" };
+  /* every density is read and written once per update, the obstacle mask read once */
+  const double bytes   = 2.0 * NSPEEDS * sizeof(t_pop) + sizeof(uint8_t);
+  const double updates = (double)params.nx * params.ny * iterations;
+  const double mlups   = (elapsed > 0.0) ? updates / elapsed * 1e-6 : 0.0;
+  const double gbs     = (elapsed > 0.0) ? updates * bytes / elapsed * 1e-9 : 0.0;
+  double* all = NULL;   /* every rank's phase times, NPHASES per rank (MASTER) */
+  double  lo[NPHASES], mean[NPHASES], hi[NPHASES]; /* over ranks */
+  FILE*   fp;           /* file pointer */
+
+  if (rank == MASTER)
+  {
+    all = (double*)malloc(sizeof(double) * NPHASES * size);
+
+    if (all == NULL) die("cannot allocate memory for timings", __LINE__, __FILE__);
+  }
+
+  MPI_Gather(timers->phase, NPHASES, MPI_DOUBLE, all, NPHASES, MPI_DOUBLE, MASTER, params.comm);
+
+  if (rank != MASTER) return EXIT_SUCCESS;
+
+  printf("Lattice updates:\t\t%.2f (MLUPS)\n", mlups);
+  printf("Memory bandwidth:\t\t%.2f (GB/s, %.0f bytes per update)\n", gbs, bytes);
+  printf("Phase times (s):\t\tmin / mean / max over ranks\n");
+
+  for (int pp = 0; pp < NPHASES; pp++)
+  {
+    lo[pp] = hi[pp] = all[pp];
+    mean[pp] = 0.0;
+
+    for (int rr = 0; rr < size; rr++)
+    {
+      const double t = all[pp + rr*NPHASES];
+
+      if (t < lo[pp]) lo[pp] = t;
+      if (t > hi[pp]) hi[pp] = t;
+      mean[pp] += t / size;
+    }
+
+    printf("  %-12s\t\t\t%.6lf / %.6lf / %.6lf\n", names[pp], lo[pp], mean[pp], hi[pp]);
+  }
+
+  if (json_path != NULL)
+  {
+    fp = fopen(json_path, "w");
+
+    if (fp == NULL)
+    {
+      char message[1024];
+
+      sprintf(message, "could not open timings file: %s", json_path);
+      die(message, __LINE__, __FILE__);
+    }
+
+    fprintf(fp, "{\n  \"nx\": %d,\n  \"ny\": %d,\n  \"iterations\": %d,\n", params.nx, params.ny, iterations);
+    fprintf(fp, "  \"ranks\": %d,\n", size);
+    #ifdef _OPENMP
+    fprintf(fp, "  \"threads_per_rank\": %d,\n", omp_get_max_threads());
+    #else
+    fprintf(fp, "  \"threads_per_rank\": 1,\n");
+    #endif
+    fprintf(fp, "  \"kernel\": \"%s\",\n  \"tb_depth\": %d,\n", isa_name, params.halo);
+    fprintf(fp, "  \"elapsed\": %.6f,\n  \"mlups\": %.3f,\n", elapsed, mlups);
+    fprintf(fp, "  \"bytes_per_update\": %.0f,\n  \"bandwidth_gbs\": %.3f,\n", bytes, gbs);
+    fprintf(fp, "  \"load_imbalance\": %.4f,\n", params.imbalance);
+    fprintf(fp, "  \"phases\": {\n");
+
+    for (int pp = 0; pp < NPHASES; pp++)
+    {
+      fprintf(fp, "    \"%s\": { \"min\": %.6f, \"mean\": %.6f, \"max\": %.6f, \"ranks\": [",
+              names[pp], lo[pp], mean[pp], hi[pp]);
+
+      for (int rr = 0; rr < size; rr++)
+      {
+        fprintf(fp, "%s%.6f", rr ? ", " : "", all[pp + rr*NPHASES]);
+      }
+
+      fprintf(fp, "] }%s\n", (pp < NPHASES - 1) ? "," : "");
+    }
+
+    fprintf(fp, "  }\n}\n");
+    fclose(fp);
+  }
+
+  free(all);
+
+  return EXIT_SUCCESS;
+}
+
+int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr,
+             uint8_t** obstacles_ptr, t_obstacle_list* obstacle_list, float** av_vels_ptr,
+             t_arena* arena)
+{
+  /*
+  ** free up allocated memory
+  ** - the grids, obstacle mask and halo buffers all go with the arena
+  */
+  arena_free(arena);
+  *cells_ptr     = NULL;
+  *tmp_cells_ptr = NULL;
+  *obstacles_ptr = NULL;
+
+  free(obstacle_list->row_start + (1 - params->halo));
+  obstacle_list->row_start = NULL;
+
+  free(obstacle_list->cols);
+  obstacle_list->cols = NULL;
+
+  free(obstacle_list->span_start + (1 - params->halo));
+  obstacle_list->span_start = NULL;
+
+  free(obstacle_list->span_lo);
+  obstacle_list->span_lo = NULL;
+
+  free(obstacle_list->span_hi);
+  obstacle_list->span_hi = NULL;
+
+  free(params->accel_rows + (1 - params->halo));
 
   free(*av_vels_ptr);
   *av_vels_ptr = NULL;
@@ -1056,6 +4748,134 @@ int finalise(const t_param* params, t_speed** cells_ptr, t_speed** tmp_cells_ptr
   return EXIT_SUCCESS;
 }
 
+int arena_init(t_arena* arena, const size_t bytes, const int huge_pages)
+{
+  const size_t round = huge_pages ? HUGEPAGE : ALIASPAGE;
+
+  arena->size    = (bytes + round - 1) / round * round;
+  arena->used    = 0;
+  arena->streams = 0;
+
+  #ifdef MAP_ANONYMOUS
+  /* room to round the start up to a huge page, which THP needs */
+  arena->map_size = arena->size + (huge_pages ? HUGEPAGE : 0);
+  arena->map = (char*)mmap(NULL, arena->map_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+  if (arena->map == MAP_FAILED) die("cannot map memory for the grids", __LINE__, __FILE__);
+
+  arena->base = arena->map;
+
+  if (huge_pages)
+  {
+    #ifdef MADV_HUGEPAGE
+    arena->base += (HUGEPAGE - (uintptr_t)arena->map % HUGEPAGE) % HUGEPAGE;
+
+    if (madvise(arena->base, arena->size, MADV_HUGEPAGE) != 0)
+    {
+      die("--huge-pages: transparent huge pages are not available", __LINE__, __FILE__);
+    }
+    #else
+    die("--huge-pages is not supported on this system", __LINE__, __FILE__);
+    #endif
+  }
+  #else
+  if (huge_pages) die("--huge-pages is not supported on this system", __LINE__, __FILE__);
+
+  arena->map_size = arena->size;
+
+  if (posix_memalign((void**)&arena->map, ALIASPAGE, arena->size) != 0)
+  {
+    die("cannot allocate memory for the grids", __LINE__, __FILE__);
+  }
+
+  arena->base = arena->map;
+  #endif
+
+  /* pages are untouched until init_cells() places them, thread by thread */
+  return EXIT_SUCCESS;
+}
+
+void* arena_alloc(t_arena* arena, const size_t bytes, const int streams)
+{
+  const uintptr_t skew = (uintptr_t)arena->streams * ALIASSKEW % ALIASPAGE;
+  uintptr_t at = (uintptr_t)(arena->base + arena->used);
+
+  /* base is page aligned, so this is also ALIGNMENT aligned */
+  at += (skew + ALIASPAGE - at % ALIASPAGE) % ALIASPAGE;
+
+  if (at + bytes > (uintptr_t)(arena->base + arena->size)) return NULL;
+
+  arena->used     = at + bytes - (uintptr_t)arena->base;
+  arena->streams += streams;
+
+  return (void*)at;
+}
+
+int arena_free(t_arena* arena)
+{
+  if (arena->map == NULL) return EXIT_SUCCESS;
+
+  #ifdef MAP_ANONYMOUS
+  munmap(arena->map, arena->map_size);
+  #else
+  free(arena->map);
+  #endif
+  arena->map  = NULL;
+  arena->base = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+#ifdef SOA
+/* bytes per speed plane: a whole no. of pages plus ALIASSKEW, so plane kk
+** starts kk * ALIASSKEW further into a page than plane 0 */
+static size_t plane_bytes(const t_param* params)
+{
+  const size_t lead = GRIDLEAD + (size_t)(params->halo - 1) * params->pitch;
+  const size_t rows = (size_t)params->local_ny + 2 * params->halo;
+  const size_t bytes = sizeof(t_pop) * (lead + rows * params->pitch);
+
+  return (bytes + ALIASPAGE - 1) / ALIASPAGE * ALIASPAGE + ALIASSKEW;
+}
+#endif
+
+size_t grid_bytes(const t_param* params)
+{
+  #ifdef SOA
+  return sizeof(t_speed) + NSPEEDS * plane_bytes(params);
+  #else
+  const size_t lead = GRIDLEAD + (size_t)(params->halo - 1) * params->pitch;
+  const size_t rows = (size_t)params->local_ny + 2 * params->halo;
+
+  return sizeof(t_speed) * (lead + rows * params->pitch);
+  #endif
+}
+
+t_speed* alloc_grid(const t_param* params, t_arena* arena)
+{
+  const size_t lead = GRIDLEAD + (size_t)(params->halo - 1) * params->pitch; /* cells ahead of row 0 */
+  #ifdef SOA
+  const size_t plane = plane_bytes(params) / sizeof(t_pop); /* t_pops per speed plane */
+  t_speed* grid  = (t_speed*)arena_alloc(arena, sizeof(t_speed), 1);
+  t_pop*   block = (t_pop*)arena_alloc(arena, NSPEEDS * plane_bytes(params), NSPEEDS); /* all nine planes */
+
+  if (grid == NULL || block == NULL) return NULL;
+
+  /* plane is a multiple of ALIGN_FLOATS, so every plane (and row) stays aligned */
+  for (int kk = 0; kk < NSPEEDS; kk++)
+  {
+    grid->speeds[kk] = block + kk * plane + lead;
+  }
+
+  return grid;
+  #else
+  t_speed* block = (t_speed*)arena_alloc(arena, grid_bytes(params), 1);
+
+  return (block == NULL) ? NULL : block + lead;
+  #endif
+}
+
 void die(const char* message, const int line, const char* file)
 {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
@@ -1066,6 +4886,14 @@ void die(const char* message, const int line, const char* file)
 
 void usage(const char* exe)
 {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [--isa=auto|scalar|avx2|avx512|neon] [--av-batch=K]\n"
+                  "       [--output-format=text|binary] [--tb-depth=K] [--specialise=yes|no]\n"
+                  "       [--converge=TOL] [--converge-window=K]\n"
+                  "       [--checkpoint=FILE] [--checkpoint-every=K] [--restart=FILE]\n"
+                  "       [--blocked-cost=W] [--timings=FILE]\n"
+                  "       [--check-av-vels=FILE] [--check-final-state=FILE] [--check-tolerance=PCT]\n"
+                  "       [--av-vels=memory|stream] [--ensemble=FILE] [--ensemble-groups=G]\n"
+                  "       [--huge-pages=yes|no] [--proc-grid=rows|auto|RxC]\n"
+                  "       [--skip-solid=yes|no] [--accel-rows=LIST|all]\n", exe);
   exit(EXIT_FAILURE);
 }
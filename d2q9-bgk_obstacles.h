@@ -0,0 +1,16 @@
+/*
+** Binary obstacle (geometry) file format, shared by d2q9-bgk.c and the
+** d2q9-obstacles converter.
+**
+**   OBSTACLESHEADER bytes:  8 byte OBSTACLESMAGIC, int nx, int ny
+**   then ny rows of OBSTACLESROWBYTES(nx) bytes, row 0 first
+**
+** Cell (ii, jj) is blocked if bit (ii % 8) of byte (ii / 8) of row jj is
+** set (least significant bit first). Integers are in native byte order.
+** A rank only needs to map, and so read, the rows of its own slab.
+*/
+
+#define OBSTACLESMAGIC        "D2Q9OB01"
+#define OBSTACLESMAGICLEN     8
+#define OBSTACLESHEADER       (OBSTACLESMAGICLEN + 2 * (int)sizeof(int))
+#define OBSTACLESROWBYTES(nx) (((nx) + 7) / 8)
@@ -0,0 +1,18 @@
+/*
+** Grid shapes the collision kernels are specialised for, one
+**
+**   SHAPE(id, nx, omega)
+**
+** per line. d2q9-bgk.c defines SHAPE() and includes this file to build,
+** for every kernel, a copy in which nx, the row pitch and omega are
+** compile-time constants (collision_id, collision_avx2_id, ...), and a
+** table that select_collision() searches at start-up. Runs whose
+** parameter file matches no entry use the generic kernels.
+**
+** These are the shapes of the input_*.params files (ny does not appear
+** in the kernels, so 128x128 and 128x256 share an entry).
+*/
+
+SHAPE(nx128,  128,  1.85f)
+SHAPE(nx256,  256,  1.85f)
+SHAPE(nx1024, 1024, 1.85f)
@@ -0,0 +1,219 @@
+/*
+** Hand-vectorised fused propagate/rebound/collision kernel.
+**
+** This file is a template: d2q9-bgk.c includes it once per instruction
+** set, after defining the vector type and operations below, e.g. for AVX2
+**
+**   #define SIMD_NAME      collision_avx2
+**   #define SIMD_WIDTH     8
+**   #define VF             __m256
+**   #define VM             __m256
+**   ...
+**   #include "d2q9-bgk_simd.h"
+**
+** SIMD_NAME         name of the kernel function to define
+** SIMD_WIDTH        no. of floats per vector
+** VF                vector of floats
+** VSET1(x)          broadcast x to all lanes
+** VLOADU(p)         unaligned load of SIMD_WIDTH floats from p
+** VSTOREU(p, v)     unaligned store of v to p
+** VADD/VSUB/VMUL/VDIV(a, b)
+** VSQRT(a)
+** VFLUID(p)         SIMD_WIDTH obstacle mask bytes from p as floats, 1 for fluid, 0 for blocked
+**
+** Every cell is relaxed as if it were fluid, so the vector loop needs no
+** branches; the blocked cells of each row are then overwritten from the
+** obstacle list by rebound_row(). The mask only weights the velocity
+** norms the kernel sums for av_velocity(). Solid tiles (--skip-solid)
+** are left out: the row is done span by span, as collision_row() does.
+**
+** Besides SIMD_NAME itself this defines SIMD_NAME_row(), the update of
+** one row, and from it a SIMD_NAME_id() kernel for each SHAPE() in
+** d2q9-bgk_shapes.h plus their table SIMD_NAME_shapes[].
+**
+** Only built for the SOA layout; the macros are undefined again at the
+** bottom of this file so the next instruction set can redefine them.
+*/
+
+#define SIMD_CAT_(a, b)  a##_##b
+#define SIMD_CAT(a, b)   SIMD_CAT_(a, b)
+#define SIMD_ROW         SIMD_CAT(SIMD_NAME, row)
+#define SIMD_SPAN        SIMD_CAT(SIMD_NAME, span)
+
+static inline float SIMD_SPAN(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                              const uint8_t* obstacles, const int jj, const int lo, const int hi)
+{
+  /* c_sq = 1/3, so 1 / c_sq = 3, 1 / (2 c_sq^2) = 4.5 and 1 / (2 c_sq) = 1.5 */
+  const VF one   = VSET1(1.f);
+  const VF c1    = VSET1(3.f);
+  const VF c2    = VSET1(4.5f);
+  const VF c3    = VSET1(1.5f);
+  const VF w0    = VSET1(4.f / 9.f);  /* weighting factor */
+  const VF w1    = VSET1(1.f / 9.f);  /* weighting factor */
+  const VF w2    = VSET1(1.f / 36.f); /* weighting factor */
+  const VF omega = VSET1(params.omega);
+
+  const int row   = jj * params.pitch;  /* this row */
+  const int row_n = row + params.pitch; /* row to the north (y_n) */
+  const int row_s = row - params.pitch; /* row to the south (y_s) */
+  const int nvec  = hi - (hi - lo) % SIMD_WIDTH;  /* columns done by the vector loop end here */
+  VF tot_u = VSET1(0.f);                          /* velocity norms, per lane */
+  float lanes[SIMD_WIDTH];
+  float span_u = 0.f;
+
+  /* SIMD_WIDTH cells at a time: the ghost columns make every
+  ** x-neighbour part of the same row, so the pulls are plain
+  ** unaligned loads one float left or right of the cell */
+  for (int ii = lo; ii < nvec; ii += SIMD_WIDTH)
+  {
+    /* propagate: pull densities from neighbouring cells */
+    const VF s0 = VLOADU(&cells->speeds[0][row   + ii]);     /* central cell, no movement */
+    const VF s1 = VLOADU(&cells->speeds[1][row   + ii - 1]); /* east */
+    const VF s2 = VLOADU(&cells->speeds[2][row_s + ii]);     /* north */
+    const VF s3 = VLOADU(&cells->speeds[3][row   + ii + 1]); /* west */
+    const VF s4 = VLOADU(&cells->speeds[4][row_n + ii]);     /* south */
+    const VF s5 = VLOADU(&cells->speeds[5][row_s + ii - 1]); /* north-east */
+    const VF s6 = VLOADU(&cells->speeds[6][row_s + ii + 1]); /* north-west */
+    const VF s7 = VLOADU(&cells->speeds[7][row_n + ii + 1]); /* south-west */
+    const VF s8 = VLOADU(&cells->speeds[8][row_n + ii - 1]); /* south-east */
+
+    /* local density and velocity components */
+    const VF local_density = VADD(VADD(VADD(VADD(s0, s1), VADD(s2, s3)),
+                                       VADD(VADD(s4, s5), VADD(s6, s7))), s8);
+    const VF u_x = VDIV(VSUB(VADD(VADD(s1, s5), s8), VADD(VADD(s3, s6), s7)), local_density);
+    const VF u_y = VDIV(VSUB(VADD(VADD(s2, s5), s6), VADD(VADD(s4, s7), s8)), local_density);
+
+    /* 1 - u_sq / (2 c_sq) is common to every equilibrium density */
+    const VF u_sq = VADD(VMUL(u_x, u_x), VMUL(u_y, u_y));
+    const VF base = VSUB(one, VMUL(u_sq, c3));
+
+    /* relaxation leaves u unchanged, so this is |u| of the new state */
+    tot_u = VADD(tot_u, VMUL(VFLUID(&obstacles[row + ii]), VSQRT(u_sq)));
+
+    /* directional velocity components */
+    const VF u1 = u_x;           /* east */
+    const VF u2 = u_y;           /* north */
+    const VF u5 = VADD(u_x, u_y); /* north-east */
+    const VF u6 = VSUB(u_y, u_x); /* north-west */
+
+    /* equilibrium densities, opposite directions only differ in the sign of u / c_sq */
+    const VF rho_w1 = VMUL(w1, local_density);
+    const VF rho_w2 = VMUL(w2, local_density);
+    const VF q1 = VADD(base, VMUL(VMUL(u1, u1), c2));
+    const VF q2 = VADD(base, VMUL(VMUL(u2, u2), c2));
+    const VF q5 = VADD(base, VMUL(VMUL(u5, u5), c2));
+    const VF q6 = VADD(base, VMUL(VMUL(u6, u6), c2));
+    const VF d0 = VMUL(VMUL(w0, local_density), base);
+    const VF d1 = VMUL(rho_w1, VADD(q1, VMUL(u1, c1)));
+    const VF d3 = VMUL(rho_w1, VSUB(q1, VMUL(u1, c1)));
+    const VF d2 = VMUL(rho_w1, VADD(q2, VMUL(u2, c1)));
+    const VF d4 = VMUL(rho_w1, VSUB(q2, VMUL(u2, c1)));
+    const VF d5 = VMUL(rho_w2, VADD(q5, VMUL(u5, c1)));
+    const VF d7 = VMUL(rho_w2, VSUB(q5, VMUL(u5, c1)));
+    const VF d6 = VMUL(rho_w2, VADD(q6, VMUL(u6, c1)));
+    const VF d8 = VMUL(rho_w2, VSUB(q6, VMUL(u6, c1)));
+
+    /* relaxation step, writing into the other grid */
+    VSTOREU(&tmp_cells->speeds[0][row + ii], VADD(s0, VMUL(omega, VSUB(d0, s0))));
+    VSTOREU(&tmp_cells->speeds[1][row + ii], VADD(s1, VMUL(omega, VSUB(d1, s1))));
+    VSTOREU(&tmp_cells->speeds[2][row + ii], VADD(s2, VMUL(omega, VSUB(d2, s2))));
+    VSTOREU(&tmp_cells->speeds[3][row + ii], VADD(s3, VMUL(omega, VSUB(d3, s3))));
+    VSTOREU(&tmp_cells->speeds[4][row + ii], VADD(s4, VMUL(omega, VSUB(d4, s4))));
+    VSTOREU(&tmp_cells->speeds[5][row + ii], VADD(s5, VMUL(omega, VSUB(d5, s5))));
+    VSTOREU(&tmp_cells->speeds[6][row + ii], VADD(s6, VMUL(omega, VSUB(d6, s6))));
+    VSTOREU(&tmp_cells->speeds[7][row + ii], VADD(s7, VMUL(omega, VSUB(d7, s7))));
+    VSTOREU(&tmp_cells->speeds[8][row + ii], VADD(s8, VMUL(omega, VSUB(d8, s8))));
+  }
+
+  VSTOREU(lanes, tot_u);
+
+  for (int ll = 0; ll < SIMD_WIDTH; ll++)
+  {
+    span_u += lanes[ll];
+  }
+
+  /* remaining columns */
+  for (int ii = nvec; ii < hi; ii++)
+  {
+    span_u += (float)(1 - obstacles[row + ii]) * collision_cell(params, cells, tmp_cells, ii, jj);
+  }
+
+  return span_u;
+}
+
+static inline float SIMD_ROW(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                             const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                             const int jj)
+{
+  float row_u = 0.f;
+
+  /* runs of tiles start on multiples of TILEWIDTH, so only a row's last
+  ** span has remainder columns */
+  if (row_unbroken(params, obstacle_list, jj))
+  {
+    row_u = SIMD_SPAN(params, cells, tmp_cells, obstacles, jj, 0, params.local_nx);
+  }
+  else
+  {
+    for (int ss = obstacle_list->span_start[jj]; ss < obstacle_list->span_start[jj + 1]; ss++)
+    {
+      row_u += SIMD_SPAN(params, cells, tmp_cells, obstacles, jj,
+                         obstacle_list->span_lo[ss], obstacle_list->span_hi[ss]);
+    }
+  }
+
+  /* rebound: the blocked cells of this row take the mirrored densities */
+  rebound_row(params, cells, tmp_cells, obstacle_list, jj);
+
+  /* the next timestep's forcing, as collision_row() does */
+  if (params.accel_fold && params.accel_rows[jj]) accelerate_row(params, tmp_cells, obstacles, jj);
+
+  return row_u;
+}
+
+static int SIMD_NAME(const t_param params, t_speed* cells, t_speed* tmp_cells,
+                     const uint8_t* obstacles, const t_obstacle_list* obstacle_list,
+                     int jj_start, int jj_end, float* tot_u)
+{
+  float rows_u = 0.f;
+
+  /* rows are shared out between threads */
+  #pragma omp parallel for schedule(static) reduction(+:rows_u)
+  for (int jj = jj_start; jj <= jj_end; jj++)
+  {
+    rows_u += SIMD_ROW(params, cells, tmp_cells, obstacles, obstacle_list, jj);
+  }
+
+  *tot_u += rows_u;
+
+  return EXIT_SUCCESS;
+}
+
+/* the same kernel for each fixed shape */
+#define SHAPE(id, nx, omega) SPECIALISED_KERNEL(SIMD_CAT(SIMD_NAME, id), SIMD_ROW, nx, omega)
+#include "d2q9-bgk_shapes.h"
+#undef SHAPE
+
+static const t_shape_kernel SIMD_CAT(SIMD_NAME, shapes)[] = {
+#define SHAPE(id, nx, omega) { nx, omega, SIMD_CAT(SIMD_NAME, id) },
+#include "d2q9-bgk_shapes.h"
+#undef SHAPE
+  { 0, 0.f, NULL }
+};
+
+#undef SIMD_CAT_
+#undef SIMD_CAT
+#undef SIMD_ROW
+#undef SIMD_SPAN
+#undef SIMD_NAME
+#undef SIMD_WIDTH
+#undef VF
+#undef VSET1
+#undef VLOADU
+#undef VSTOREU
+#undef VADD
+#undef VSUB
+#undef VMUL
+#undef VDIV
+#undef VSQRT
+#undef VFLUID
@@ -0,0 +1,24 @@
+/*
+** Binary final state format (--output-format=binary), shared by d2q9-bgk.c
+** and the d2q9-check validator.
+**
+**   FINALSTATEHEADER bytes:  8 byte FINALSTATEMAGIC, int nx, int ny
+**   then nx * ny t_state_record, row-major order, row 0 first
+**
+** Integers and floats are in native byte order. The text format has the
+** same values, one "ii jj u_x u_y u pressure obstacle" line per cell.
+*/
+
+#define FINALSTATEMAGIC     "D2Q9FS01"
+#define FINALSTATEMAGICLEN  8
+#define FINALSTATEHEADER    (FINALSTATEMAGICLEN + 2 * (int)sizeof(int))
+
+/* one cell of the binary final state */
+typedef struct
+{
+  float u_x;       /* x-component of velocity */
+  float u_y;       /* y-component of velocity */
+  float u;         /* norm of velocity */
+  float pressure;  /* fluid pressure */
+  int   obstacle;  /* 1 if the cell is blocked */
+} t_state_record;
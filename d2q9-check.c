@@ -0,0 +1,343 @@
+/*
+** Compare the output of a run with reference results, as check/check.py
+** does, in one streaming pass over the files instead of loading them:
+**
+**   ./d2q9-check [--tolerance=PCT] <ref_av_vels> <ref_final_state> <av_vels> <final_state>
+**
+** The final states can be text or binary (--output-format=binary, see
+** d2q9-bgk_state.h), in any mix. A value fails if it differs from the
+** reference by more than PCT % (1 by default) of the computed value, or
+** is not finite; the exit status is 1 if either file fails.
+**
+** A text reference can be converted once, so that later checks (and
+** d2q9-bgk --check-final-state=) only read the binary one:
+**
+**   ./d2q9-check --convert check/1024x1024.final_state.dat 1024x1024.final_state.bin
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "d2q9-bgk_state.h"
+
+/* a final state file being read, one cell at a time */
+typedef struct
+{
+  FILE* fp;       /* file pointer */
+  int   binary;   /* 1 for the binary format */
+  int   nx, ny;   /* grid dimensions (binary header) */
+  long  cell;     /* no. of cells read so far */
+} t_state_file;
+
+/* the largest difference in a series of values, as check.py reports it */
+typedef struct
+{
+  long   count;   /* no. of values compared */
+  double total;   /* sum of |ref - sim| */
+  long   step;    /* index of the largest |% difference| */
+  int    ii, jj;  /* coordinates of that value (final state) */
+  double diff;    /* ref - sim there */
+  double pcnt;    /* 100 * diff / sim there */
+  double sim;
+  double ref;
+} t_diffs;
+
+void open_state(t_state_file* state, const char* path);
+/* reads the next cell's coordinates and record, returns 0 at the end of the file; the
+** pressure is also returned in double precision, as the text file has more digits */
+int  read_state(t_state_file* state, int* ii, int* jj, t_state_record* record, double* pressure);
+void add_diff(t_diffs* diffs, const double ref, const double sim, const int ii, const int jj);
+int  check_av_vels(const char* ref_path, const char* sim_path, double tolerance);
+int  check_final_state(const char* ref_path, const char* sim_path, double tolerance);
+int  convert(const char* text_path, const char* binary_path);
+void die(const char* message, const int line, const char* file);
+void usage(const char* exe);
+
+int main(int argc, char* argv[])
+{
+  double tolerance = 1.0;  /* % difference allowed */
+  int    aa = 1;           /* first positional argument */
+  int    failed;
+
+  if (argc == 4 && strcmp(argv[1], "--convert") == 0) return convert(argv[2], argv[3]);
+
+  if (argc > 1 && strncmp(argv[1], "--tolerance=", 12) == 0)
+  {
+    tolerance = atof(argv[1] + 12);
+    aa++;
+  }
+
+  if (argc - aa != 4) usage(argv[0]);
+
+  failed  = check_av_vels(argv[aa], argv[aa + 2], tolerance);
+  failed |= check_final_state(argv[aa + 1], argv[aa + 3], tolerance);
+
+  if (failed) return EXIT_FAILURE;
+
+  printf("Both tests passed!\n");
+
+  return EXIT_SUCCESS;
+}
+
+void open_state(t_state_file* state, const char* path)
+{
+  char message[1024];                 /* message buffer */
+  char magic[FINALSTATEMAGICLEN] = {0}; /* first bytes of the file */
+  int  dims[2];                       /* nx, ny from the header */
+
+  state->fp = fopen(path, "rb");
+
+  if (state->fp == NULL)
+  {
+    sprintf(message, "could not open final state file: %s", path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  state->cell = 0;
+  state->binary = fread(magic, 1, FINALSTATEMAGICLEN, state->fp) == FINALSTATEMAGICLEN
+                  && memcmp(magic, FINALSTATEMAGIC, FINALSTATEMAGICLEN) == 0;
+
+  if (!state->binary)
+  {
+    rewind(state->fp);
+    return;
+  }
+
+  if (fread(dims, sizeof(int), 2, state->fp) != 2)
+  {
+    sprintf(message, "binary final state file is truncated: %s", path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  state->nx = dims[0];
+  state->ny = dims[1];
+}
+
+int read_state(t_state_file* state, int* ii, int* jj, t_state_record* record, double* pressure)
+{
+  if (state->binary)
+  {
+    if (state->cell == (long)state->nx * state->ny) return 0;
+
+    if (fread(record, sizeof(*record), 1, state->fp) != 1)
+    {
+      die("binary final state file is truncated", __LINE__, __FILE__);
+    }
+
+    *ii = (int)(state->cell % state->nx);
+    *jj = (int)(state->cell / state->nx);
+    *pressure = record->pressure;
+  }
+  else
+  {
+    const int retval = fscanf(state->fp, "%d %d %e %e %e %lf %d\n", ii, jj, &record->u_x,
+                              &record->u_y, &record->u, pressure, &record->obstacle);
+
+    if (retval == EOF) return 0;
+
+    if (retval != 7) die("expected 7 values per line in final state file", __LINE__, __FILE__);
+
+    record->pressure = (float)*pressure;
+  }
+
+  state->cell++;
+
+  return 1;
+}
+
+void add_diff(t_diffs* diffs, const double ref, const double sim, const int ii, const int jj)
+{
+  const double diff = ref - sim;
+  const double pcnt = 100.0 * (diff / (ref - diff));
+
+  /* the first value that is not finite counts as the largest, like numpy's argmax */
+  if (diffs->count == 0 || (isfinite(diffs->pcnt) && !(fabs(pcnt) <= fabs(diffs->pcnt))))
+  {
+    diffs->step = diffs->count;
+    diffs->ii   = ii;
+    diffs->jj   = jj;
+    diffs->diff = diff;
+    diffs->pcnt = pcnt;
+    diffs->sim  = sim;
+    diffs->ref  = ref;
+  }
+
+  diffs->total += fabs(diff);
+  diffs->count++;
+}
+
+int check_av_vels(const char* ref_path, const char* sim_path, double tolerance)
+{
+  char    message[1024];  /* message buffer */
+  FILE*   ref_fp;
+  FILE*   sim_fp;
+  double  ref, sim;       /* one timestep's values */
+  int     ref_ok, sim_ok; /* whether a value was read from each */
+  t_diffs diffs = {0};
+
+  ref_fp = fopen(ref_path, "r");
+  sim_fp = fopen(sim_path, "r");
+
+  if (ref_fp == NULL || sim_fp == NULL)
+  {
+    sprintf(message, "could not open av_vels file: %s", (ref_fp == NULL) ? ref_path : sim_path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* "step:\tvalue" lines, side by side */
+  for (;;)
+  {
+    ref_ok = fscanf(ref_fp, "%*d: %lf", &ref) == 1;
+    sim_ok = fscanf(sim_fp, "%*d: %lf", &sim) == 1;
+
+    if (!ref_ok || !sim_ok) break;
+
+    add_diff(&diffs, ref, sim, 0, 0);
+  }
+
+  fclose(ref_fp);
+  fclose(sim_fp);
+
+  if (ref_ok != sim_ok)
+  {
+    printf("Different number of steps in av_vels files\n");
+    return 1;
+  }
+
+  printf("Total difference in av_vels : %.12E\n", diffs.total);
+  printf("Biggest difference (at step %ld) : %.12E\n", diffs.step, diffs.diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n\n", diffs.sim, diffs.ref, diffs.pcnt);
+
+  if (!isfinite(diffs.pcnt) || fabs(diffs.pcnt) > tolerance)
+  {
+    printf("av_vels failed check\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+int check_final_state(const char* ref_path, const char* sim_path, double tolerance)
+{
+  t_state_file   ref_state, sim_state;
+  t_state_record ref, sim;        /* one cell of each */
+  double         ref_p, sim_p;    /* its pressure in each */
+  int            ref_ii, ref_jj;  /* its coordinates in each */
+  int            sim_ii, sim_jj;
+  int            ref_ok, sim_ok;  /* whether a cell was read from each */
+  t_diffs        diffs = {0};
+
+  open_state(&ref_state, ref_path);
+  open_state(&sim_state, sim_path);
+
+  for (;;)
+  {
+    ref_ok = read_state(&ref_state, &ref_ii, &ref_jj, &ref, &ref_p);
+    sim_ok = read_state(&sim_state, &sim_ii, &sim_jj, &sim, &sim_p);
+
+    if (!ref_ok || !sim_ok) break;
+
+    if (ref_ii != sim_ii || ref_jj != sim_jj) break;
+
+    add_diff(&diffs, ref_p, sim_p, sim_ii, sim_jj);
+  }
+
+  fclose(ref_state.fp);
+  fclose(sim_state.fp);
+
+  if (ref_ok != sim_ok || (ref_ok && (ref_ii != sim_ii || ref_jj != sim_jj)))
+  {
+    printf("Final state files coordinates were not the same\n");
+    return 1;
+  }
+
+  printf("Total difference in final_state : %.12E\n", diffs.total);
+  printf("Biggest difference (at coord (%d,%d)) : %.12E\n", diffs.ii, diffs.jj, diffs.diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n\n", diffs.sim, diffs.ref, diffs.pcnt);
+
+  if (!isfinite(diffs.pcnt) || fabs(diffs.pcnt) > tolerance)
+  {
+    printf("final state failed check\n");
+    return 1;
+  }
+
+  return 0;
+}
+
+int convert(const char* text_path, const char* binary_path)
+{
+  char           message[1024];  /* message buffer */
+  t_state_file   text;
+  t_state_record record;
+  double         pressure;       /* unused, the record has it */
+  int            ii, jj;         /* coordinates of a cell */
+  int            dims[2] = { 0, 0 }; /* nx, ny, known once row 1 starts */
+  FILE*          fp;
+
+  open_state(&text, text_path);
+
+  if (text.binary) die("final state file is already binary", __LINE__, __FILE__);
+
+  fp = fopen(binary_path, "wb");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open output file: %s", binary_path);
+    die(message, __LINE__, __FILE__);
+  }
+
+  /* the header is filled in at the end, once the last cell gives nx and ny */
+  if (fseek(fp, FINALSTATEHEADER, SEEK_SET) != 0) die("could not write binary final state", __LINE__, __FILE__);
+
+  while (read_state(&text, &ii, &jj, &record, &pressure))
+  {
+    const long cell = text.cell - 1; /* index of this one */
+
+    /* row-major order is all the binary format has for coordinates */
+    if (jj == 0)
+    {
+      if (ii != cell) die("text final state is not in row-major order", __LINE__, __FILE__);
+
+      dims[0] = ii + 1;
+    }
+    else if (ii != cell % dims[0] || jj != cell / dims[0])
+    {
+      die("text final state is not in row-major order", __LINE__, __FILE__);
+    }
+
+    dims[1] = jj + 1;
+
+    if (fwrite(&record, sizeof(record), 1, fp) != 1) die("could not write binary final state", __LINE__, __FILE__);
+  }
+
+  if ((long)dims[0] * dims[1] != text.cell) die("text final state is not a full grid", __LINE__, __FILE__);
+
+  rewind(fp);
+
+  if (fwrite(FINALSTATEMAGIC, 1, FINALSTATEMAGICLEN, fp) != FINALSTATEMAGICLEN
+      || fwrite(dims, sizeof(int), 2, fp) != 2)
+  {
+    die("could not write binary final state", __LINE__, __FILE__);
+  }
+
+  fclose(fp);
+  fclose(text.fp);
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char* file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n", message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe)
+{
+  fprintf(stderr, "Usage: %s [--tolerance=PCT] <ref_av_vels> <ref_final_state> <av_vels> <final_state>\n"
+                  "       %s --convert <text_final_state> <binary_final_state>\n", exe, exe);
+  exit(EXIT_FAILURE);
+}
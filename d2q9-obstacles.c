@@ -0,0 +1,109 @@
+/*
+** Convert a text obstacle file (one "x y 1" line per blocked cell) into
+** the bit-packed binary format described in d2q9-bgk_obstacles.h, which
+** d2q9-bgk maps one slab at a time instead of parsing.
+**
+** The grid dimensions are taken from the parameter file, e.g.:
+**
+**   ./d2q9-obstacles input_1024x1024.params obstacles_1024x1024.dat obstacles_1024x1024.bin
+**   ./d2q9-bgk input_1024x1024.params obstacles_1024x1024.bin
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "d2q9-bgk_obstacles.h"
+
+void die(const char* message, const int line, const char* file);
+
+int main(int argc, char* argv[])
+{
+  char   message[1024];  /* message buffer */
+  FILE*  fp;             /* file pointer */
+  int    nx, ny;         /* grid dimensions */
+  int    xx, yy;         /* generic array indices */
+  int    blocked;        /* indicates whether a cell is blocked by an obstacle */
+  int    retval;         /* to hold return value for checking */
+  long   row_bytes;      /* bytes per packed row */
+  unsigned char* mask;   /* the packed rows */
+
+  if (argc != 4)
+  {
+    fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> <binaryfile>\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+
+  /* nx and ny are the first two lines of the parameter file */
+  fp = fopen(argv[1], "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input parameter file: %s", argv[1]);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (fscanf(fp, "%d\n", &nx) != 1) die("could not read param file: nx", __LINE__, __FILE__);
+
+  if (fscanf(fp, "%d\n", &ny) != 1) die("could not read param file: ny", __LINE__, __FILE__);
+
+  fclose(fp);
+
+  row_bytes = OBSTACLESROWBYTES(nx);
+  mask = calloc((size_t)row_bytes * ny, 1);
+
+  if (mask == NULL) die("cannot allocate memory for obstacle mask", __LINE__, __FILE__);
+
+  /* read-in the blocked cells list, same checks as d2q9-bgk */
+  fp = fopen(argv[2], "r");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open input obstacles file: %s", argv[2]);
+    die(message, __LINE__, __FILE__);
+  }
+
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF)
+  {
+    if (retval != 3) die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+
+    if (xx < 0 || xx > nx - 1) die("obstacle x-coord out of range", __LINE__, __FILE__);
+
+    if (yy < 0 || yy > ny - 1) die("obstacle y-coord out of range", __LINE__, __FILE__);
+
+    if (blocked != 1) die("obstacle blocked value should be 1", __LINE__, __FILE__);
+
+    mask[yy * row_bytes + xx / 8] |= (unsigned char)(1 << (xx % 8));
+  }
+
+  fclose(fp);
+
+  /* header, then the packed rows */
+  fp = fopen(argv[3], "wb");
+
+  if (fp == NULL)
+  {
+    sprintf(message, "could not open output file: %s", argv[3]);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (fwrite(OBSTACLESMAGIC, 1, OBSTACLESMAGICLEN, fp) != OBSTACLESMAGICLEN
+      || fwrite(&nx, sizeof(int), 1, fp) != 1
+      || fwrite(&ny, sizeof(int), 1, fp) != 1
+      || fwrite(mask, (size_t)row_bytes, ny, fp) != (size_t)ny)
+  {
+    die("could not write binary obstacle file", __LINE__, __FILE__);
+  }
+
+  fclose(fp);
+  free(mask);
+
+  return EXIT_SUCCESS;
+}
+
+void die(const char* message, const int line, const char* file)
+{
+  fprintf(stderr, "Error at line %d of file %s:\n", line, file);
+  fprintf(stderr, "%s\n", message);
+  fflush(stderr);
+  exit(EXIT_FAILURE);
+}